@@ -1,63 +1,53 @@
 #!/usr/bin/perl
 #
 # This file demonstrates automatically generating an editor for the NVRAM
-# variables using Doxygen <http://www.stack.nl/~dimitri/doxygen/> to extract
-# type information from the C file in which the NVRAM variables are defined.
+# variables. The variables, their exact offsets, sizes and types, are found
+# in the symbol table of the executable and the descriptors it holds in its
+# "nvram_layout" section, by the inspector built from "inspect.c":
 #
-# An alternative way of doing this would be to use objdump
-# <https://sourceware.org/binutils/docs/binutils/objdump.html> to find
-# all variables in the NVRAM section. The command:
+# 	./inspect -e nvram
 #
-# 	objdump -j nvram -t nvram.elf
-#
-# Lists all of the variables in the section named "nvram" in the "nvram.elf"
-# executable.
+# This used to be done by running Doxygen over the C source and guessing the
+# offsets from an assumed alignment, which was slow and wrong for anything
+# that was not 8 bytes in size. The inspector is also used to read the values
+# from the data file and to write them back, which keeps the checksums in the
+# file up to date.
 #
 # Use:
 # 	- Perl/Tk http://search.cpan.org/dist/Tk/pod/UserGuide.pod
-# 	- TreePP http://search.cpan.org/dist/XML-TreePP/lib/XML/TreePP.pm
-# 	- BigInts http://perldoc.perl.org/bigint.html
-# 	- Pack/Unpack http://perldoc.perl.org/functions/pack.html
 # 	- Getopts http://perldoc.perl.org/Getopt/Long.html
 # 	- Datadumper https://perldoc.perl.org/Data/Dumper.html
 # 
 # @todo Make an XSD file to describe the generate XML file, and an XSLT file
 # for displaying it as a webpage
-# @todo The version number and format string should be checked, and the endianess
-# determined. Initializers should also be decoded correctly and input allowed in
-# decimal as well as hexadecimal? The format and the version fields should be protected
-# from being edited.
-# @todo The doxygen extraction of types needs to be improved to make it more
-# robust.
+# @todo The format and the version fields should be protected from being
+# edited.
 #
 use warnings;
 use strict;
 use Data::Dumper;
 use Getopt::Long;
-use XML::TreePP;
-use Tk;
 
 my $verbose   = 0;
 my $noedit    = 0;
 my $gui       = 0;
-my $nv_xml    = "doxygen/xml/nvram_8c.xml";
+my $nv_exe    = "nvram";
+my $inspect   = "./inspect";
+my $section   = "nvram";
 my $nv_data   = "nvram.blk";
 my $xml_out   = "$nv_data.xml";
-my $alignment = 8; # @todo specify this in the nvram format
-my $endian    = 1; # this can be determined by looking at the first variable
 my $help      =<<HELP
 This is an editor/data viewer for a binary format, the editor is 
-automatically generated from an XML file generated by doxygen. Doxygen
-is used to extract all of the variables within a special C program.
+automatically generated from the layout of the variables in an executable.
 
-This script expects fixed width variables (int32_t, uint8_t, etecetera) 
-to be declared with a 'NVRAM' macro, these variables are loaded and saved
-automatically by the C program at statup and exit. The variables are
-located within a special section within the executable that allows this.
+This script expects variables to be declared with a 'NVRAM' macro, these
+variables are loaded and saved automatically by the C program at startup
+and exit. The variables are located within a special section within the
+executable that allows this.
 
-	--xml,      -x  specify the XML file generated by doxygen
-	--aligment, -a  set the alignment of the data
-	--endian,   -e  specify the endianess of the data 1=little, 0=big
+	--exe,      -x  the executable the data file was written by
+	--inspect,  -i  the inspector, built from 'inspect.c'
+	--section,  -s  the section of the executable the data file holds
 	--data,     -d  the file which contains the data
 	--help,     -h  this help message
 	--gui,      -g  run GUI editor instead of command line editor
@@ -65,32 +55,32 @@ located within a special section within the executable that allows this.
 	--no-edit,  -n  do not launch the editor
 	--verbose,  -v  turn on verbose mode
 
+Numbers are entered in decimal, or in hexadecimal prefixed with '0x', other
+variables (arrays and structures) as a string of hexadecimal bytes.
+
 For more information, view the example C program at:
 <https://github.com/howerj/nvram/blob/master/nvram.c> This script should 
 be in the same repository. 
 
-The Doxygen version used to create the XML file input was version "1.8.11",
-future and previous versions of doxygen may not work.
-
 HELP
 ;
 
 GetOptions(
 	"gui|g"          => \$gui,
-	"xml|x=s"        => \$nv_xml,
-	"alignment|a=i"  => \$alignment,
-	"endian|e=i"     => \$endian,
+	"exe|x=s"        => \$nv_exe,
+	"inspect|i=s"    => \$inspect,
+	"section|s=s"    => \$section,
 	"data|d=s"       => \$nv_data,
 	"verbose|v"      => \$verbose,
 	"no-edit|n"      => \$noedit,
-	"output|o"       => \$xml_out,
+	"output|o=s"     => \$xml_out,
 	"help|h"         => sub { print $help; exit; })
 	or die "command line options error: try --help or -h for information";
 
 my $settings =<<SETTINGS
-XML:        '$nv_xml'
-ALIGNMENT:  $alignment
-ENDIAN:     $endian
+EXECUTABLE: '$nv_exe'
+INSPECTOR:  '$inspect'
+SECTION:    '$section'
 DATA:       '$nv_data'
 VEBOSITY:   $verbose
 GUI MODE:   $gui
@@ -101,106 +91,79 @@ SETTINGS
 
 print $settings if $verbose;
 
-# @todo Use force_array/force_hash to make sure the data is how this function
-# expects it. The error checking of this function could be improved.
-sub unxml($)
+# Find the variables in a section of the executable, the inspector prints a
+# line for each section followed by a line for each of its variables
+sub layout($$)
 {
-	my ($file) = @_;
-	my $tpp = XML::TreePP->new();
-	my $nv_tree = $tpp->parsefile($file);
-	my $members = $nv_tree->{doxygen}->{compounddef}->{sectiondef};
-	die "no data" if not defined $members;
-
-	my $vars  = undef;
-	foreach my $member (@{$members}) {
-		if($member->{-kind} eq "var") {
-			$vars = $member;
-			last;
-		}
-	}
-	die "no variables in file" if not defined $vars;
-
+	my ($exe, $section) = @_;
 	my @nv_vars;
-	my $location = 0;
-
-	# @todo Make sure all NVRAM variables are contiguously defined
-	foreach my $var (@{$vars->{memberdef}}) {
-		my $name   = $var->{name};
-		my $type   = $var->{type};
-		my $init   = $var->{initializer};
-		my $brief  = $var->{briefdescription};
-		my $detail = $var->{detaileddescription};
-		next unless ($type =~ m/NVRAM/);
-		my %info;
-		$type =~ s/\s*NVRAM\s*//;
-		unless ($type =~ m/(u)?int(8|16|32|64)_t/) {
-			die "can only process fixed width types (got '$name' of type '$type')";
+	my $in = 0;
+	open my $fh, "-|", $inspect, "-e", $exe or die "could not run $inspect: $!";
+	while (<$fh>) {
+		if (m/^(\S+): layout/) {
+			$in = $1 eq $section;
+		} elsif ($in and m/^\t(\S+)\s+(\S+)\s+(\d+)\s+(\d+)/) {
+			my %info;
+			$info{name}     = $1;
+			$info{type}     = $2;
+			$info{location} = $3;
+			$info{bytes}    = $4;
+			push @nv_vars, \%info;
 		}
-		my $signed = defined $1 ? 0 : 1 ;
-		my $bytes  = $2/8;
-		$init =~ s/^\s*=\s*//;
-
-		$info{name}     = $name;
-		$info{signed}   = $signed;
-		$info{bytes}    = $bytes;
-		$info{init}     = $init;
-		$info{location} = $location;
-		# $info{brief}  = $brief;
-		# $info{detail} = $detail;
-		push @nv_vars, \%info;
-		$location += $alignment;
 	}
-
-	return (\@nv_vars, $location);
+	close $fh or die "$inspect failed on $exe";
+	die "no variables in section '$section' of $exe" unless @nv_vars;
+	return \@nv_vars;
 }
 
-sub load($$$$$) {
-	my ($vars, $file, $size, $endian, $alignment) = @_;
-	my $data;
-	open FH, "<", $file or die "could not open $file for reading: $!";
-	binmode FH;
-	read FH, $data, $size;
-	close FH;
-	die "read too few bytes: $data != $size" if length $data != $size;
-
-	my $i = 0;
+sub load($$) {
+	my ($vars, $file) = @_;
+	my @args = map { ("-n", $_->{name}) } @{$vars};
+	open my $fh, "-|", $inspect, @args, $file or die "could not run $inspect: $!";
+	while (<$fh>) {
+		chomp;
+		my ($f, $name, $value) = split / /, $_, 3;
+		$value =~ s/ \(0x[0-9a-f]+\)$//;
+		foreach my $var (@{$vars}) {
+			$var->{data} = $value if $var->{name} eq $name;
+		}
+	}
+	close $fh or die "$inspect could not read $file, was it written by this executable?";
 	foreach my $var (@{$vars}) {
-		my $skip = $i * $alignment;
-		my $get  = $alignment * 2;
-		$var->{data} = unpack "x$skip h$get", $data;
-		$var->{data} = reverse $var->{data} if $endian;
-		$i++;
+		$var->{saved} = $var->{data};
 	}
 }
 
-sub save($$$$$) {
-	my ($vars, $file, $size, $endian, $alignment) = @_;
-	my $data;
+# Only the variables that have changed are written, by the inspector
+sub save($$) {
+	my ($vars, $file) = @_;
+	my @args;
 
 	foreach my $var (@{$vars}) {
-		my $get  = $alignment * 2;
-		my $value = reverse $var->{data};
-		$data .= pack "h$get", $value;
+		push @args, "-s", "$var->{name}=$var->{data}" if $var->{data} ne $var->{saved};
+	}
+	return unless @args;
+	open my $fh, "-|", $inspect, @args, "-n", $vars->[0]->{name}, $file or die "could not run $inspect: $!";
+	while (<$fh>) { } # it prints the first variable, which is not needed
+	close $fh or die "could not save $file";
+	foreach my $var (@{$vars}) {
+		$var->{saved} = $var->{data};
 	}
-
-	open FH, ">", $file or die "could not open $file for writing: $!";
-	binmode FH;
-	print FH $data;
-	close FH;
 }
 
 sub xml($$)
 {
 	my ($vars, $file) = @_;
-	my %x;
-	my $i = 0;
+	my $out = "<nvram>\n";
 	foreach my $var(@{$vars}) {
-		$x{nvram}->{variable}->[$i++] = $var;
+		$out .= "  <variable>\n";
+		foreach my $key (sort keys %{$var}) {
+			next if $key eq "saved";
+			$out .= "    <$key>$var->{$key}</$key>\n";
+		}
+		$out .= "  </variable>\n";
 	}
-
-	my $tpp = XML::TreePP->new();
-	$tpp->set(indent => 2);
-	my $out = $tpp->write(\%x);
+	$out .= "</nvram>\n";
 
 	open FH, ">", $file or die "could not open $file for writing: $!";
 	print FH $out;
@@ -208,14 +171,24 @@ sub xml($$)
 	return undef;
 }
 
+# Check a value before it is given to the inspector, which checks it again
+sub valid($$)
+{
+	my ($var, $value) = @_;
+	return $value =~ m/^([0-9a-fA-F]{2}){$var->{bytes}}$/ if $var->{type} eq "blob";
+	return $value =~ m/^[-+0-9.eE]+$/ if $var->{type} =~ m/^f/;
+	return $value =~ m/^(-?[0-9]+|0x[0-9a-fA-F]+)$/;
+}
+
 sub cli($)
 {
 	sub command($$)
 	{
 		my ($vars, $command) = @_;
 		my $command_help = <<COMMANDS
-This is the editor loop, type a variable name to edit it. Editing
-is done in hexadecimal only (this is just a demonstation program and not
+This is the editor loop, type a variable name to edit it. Numbers are
+entered in decimal, or hexadecimal prefixed with '0x', anything else as a
+string of hexadecimal bytes (this is just a demonstation program and not
 meant for serious use). Press CTRL-D to exit the edit loop.
 
 All commands are prefixed with '-'. A list of commands:
@@ -274,13 +247,11 @@ COMMANDS
 		}
 		chomp $value;
 		$value =~ s/[ \t]+//g;
-			
-		if(not ($value =~ m/^[0-9a-fA-F]+$/)) {
-			print "not a hexadecimal value: $value";
+
+		if(not &valid($var, $value)) {
+			print "not a valid value for $var->{name}: $value\n";
 			return;
 		}
-		my $l = (2 * $alignment) - length $value;
-		$value = ("0" x $l) . $value;
 		$var->{data} = $value;
 		return undef;
 	}
@@ -307,11 +278,12 @@ COMMANDS
 	print "\n";
 }
 
-sub gui($$$$$)
+sub gui($$)
 {
-	my ($vars, $file, $size, $endian, $alignment) = @_;
+	my ($vars, $file) = @_;
 
-	my $mw = new MainWindow;
+	require Tk; # only needed for the GUI
+	my $mw = MainWindow->new;
 	$mw->title("Perl/Tk NVRAM block editor");
 	#$mw->geometry($mw->screenwidth . "x" . $mw->screenheight . "+0+0");
 	my $form = $mw->Frame();
@@ -333,20 +305,17 @@ sub gui($$$$$)
 	my $gui_save = sub {
 		my $i = 0;
 		foreach my $var(@{$vars}) {
-			my $entry = $entries[$i];
+			my $entry = $entries[$i++];
 			my $value = $entry->get();
 
-			if ((not defined $value) or (not ($value =~ m/^[0-9a-fA-F]+$/))) {
+			if ((not defined $value) or (not &valid($var, $value))) {
 				my $data = $var->{data};
 				$entry->configure(-textvariable => \$data);
 				next;
 			}
-			my $l = (2 * $alignment) - length $value;
-			$value = ("0" x $l) . $value;
 			$var->{data} = $value;
-			$i++;
 		}
-		&save($vars, $file, $size, $endian, $alignment);
+		&save($vars, $file);
 		# $form->messageBox(-icon => "info", -message => "Data Saved", -title => "Saved", -type => "Ok");
 	};
 
@@ -355,23 +324,21 @@ sub gui($$$$$)
 	$mw->bind('<KeyRelease-Return>' => $gui_save);
 	$mw->bind('<KeyRelease-Escape>' => sub{ exit });
 
-	MainLoop;
+	Tk::MainLoop();
 }
 
-my ($nv_vars, $size) = &unxml($nv_xml);
-&load($nv_vars, $nv_data, $size, $endian, $alignment);
+my $nv_vars = &layout($nv_exe, $section);
+&load($nv_vars, $nv_data);
 
 if(not $noedit) {
 	if($gui) {
-		&gui($nv_vars, $nv_data, $size, $endian, $alignment);
+		&gui($nv_vars, $nv_data);
 	} else {
 		&cli($nv_vars);
 	}
-	&save($nv_vars, $nv_data, $size, $endian, $alignment);
+	&save($nv_vars, $nv_data);
 }
 
 &xml($nv_vars, $xml_out) if defined $xml_out;
 
 print Dumper($nv_vars) if $verbose;
-
-
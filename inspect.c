@@ -0,0 +1,443 @@
+/**@file inspect.c
+ * @license MIT
+ * @author Richard James Howe
+ * @copyright Richard James Howe (2017)
+ * @brief Inspector for the files written by 'nvram.c', which can also change
+ * the variables in them.
+ *
+ * Every image is stored with a table describing the variables it holds (see
+ * 'NVRAM_LAYOUT' in 'nvram.c'), so a file can be inspected without the
+ * program that wrote it, its source, or any debugging information. A file is
+ * mapped (read only, unless "-s" is given), the header of the newest valid
+ * image is found, and the variables are printed straight out of the mapping.
+ * Nothing is copied, so thousands of files can be inspected quickly in one run:
+ *
+ *	inspect nvram.blk
+ *	inspect -n nv_count -n nv_c host1.blk host2.blk host3.blk
+ *
+ * The first prints every variable in "nvram.blk", the second a line for each
+ * of the named variables in each file. The files are read with the library
+ * in 'nvram_image.c', which can be used on its own to query images from other
+ * tools.
+ *
+ * The variables can also be found from the executable, the symbol table
+ * gives the exact offset and size of every variable in each NVRAM section
+ * (including arrays and structures), and the descriptors that 'NVRAM_LAYOUT'
+ * puts in the section 'nvram_layout' give their types:
+ *
+ *	inspect -e nvram
+ *	inspect -e nvram nvram.blk hot.blk
+ *
+ * The first lists the variables, the second also says which section of the
+ * executable each file was written from, by comparing the hash of its layout.
+ * A variable can be changed with "-s name=value", this is the only option
+ * that writes to a file, the checksums of the image are updated to match.
+ * Compressed images are decompressed to be inspected, which is the only time
+ * anything is copied, and cannot be changed. */
+
+#include "nvram_image.h"
+#include "nvram_codec.h"
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <elf.h>
+
+/* ======= ELF Layout ====================================================== */
+
+#ifdef __aarch64__
+#define ELF_RELATIVE R_AARCH64_RELATIVE /**< relocation adding the load address to a pointer */
+#else
+#define ELF_RELATIVE R_X86_64_RELATIVE  /**< relocation adding the load address to a pointer */
+#endif
+
+/**< an executable, mapped read only */
+typedef struct {
+	const unsigned char *file; /**< contents of the executable */
+	size_t size;               /**< size of the executable */
+	const Elf64_Ehdr *eh;      /**< ELF header */
+	const Elf64_Shdr *sh;      /**< section headers */
+	const Elf64_Shdr *names;   /**< string table holding the section names */
+} elf_t;
+
+/**< a variable in an NVRAM section of an executable */
+typedef struct {
+	const char *section;  /**< name of the section */
+	nvram_field_t field;  /**< offset, size and type of the variable within the section */
+	uint64_t address;     /**< address of the variable */
+	bool described;       /**< has a descriptor, created with 'NVRAM_LAYOUT' */
+	char described_name[sizeof ((nvram_field_t*)0)->name]; /**< name in its descriptor */
+} nvram_symbol_t;
+
+/**< map the 64-bit ELF file 'name' written for this machine */
+static int elf_open(elf_t *e, const char *name)
+{
+	struct stat s;
+	assert(e);
+	memset(e, 0, sizeof *e);
+	errno = 0;
+	const int fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &s) < 0 || (size_t)s.st_size < sizeof (Elf64_Ehdr)
+			|| (e->file = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", name, errno ? strerror(errno) : "too small");
+		if (fd >= 0)
+			close(fd);
+		e->file = NULL;
+		return -1;
+	}
+	close(fd);
+	e->size = s.st_size;
+	e->eh = (const Elf64_Ehdr*)e->file;
+	const uint16_t one = 1;
+	const unsigned char order = *(const unsigned char*)&one ? ELFDATA2LSB : ELFDATA2MSB;
+	if (memcmp(e->eh->e_ident, ELFMAG, SELFMAG) || e->eh->e_ident[EI_CLASS] != ELFCLASS64 || e->eh->e_ident[EI_DATA] != order
+			|| e->eh->e_shentsize != sizeof (Elf64_Shdr) || e->eh->e_shoff > e->size
+			|| (size_t)e->eh->e_shnum * sizeof (Elf64_Shdr) > e->size - e->eh->e_shoff
+			|| e->eh->e_shstrndx >= e->eh->e_shnum) {
+		fprintf(stderr, "%s: not a 64-bit ELF file for this machine\n", name);
+		munmap((void*)e->file, e->size);
+		e->file = NULL;
+		return -1;
+	}
+	e->sh = (const Elf64_Shdr*)(e->file + e->eh->e_shoff);
+	e->names = &e->sh[e->eh->e_shstrndx];
+	return 0;
+}
+
+static void elf_close(elf_t *e)
+{
+	assert(e);
+	if (e->file)
+		munmap((void*)e->file, e->size);
+	e->file = NULL;
+}
+
+/**< get the string at 'offset' in the string table 'table'
+ * @return the string, NULL if it is not within the table and terminated there */
+static const char *elf_string(const elf_t *e, const Elf64_Shdr *table, uint64_t offset)
+{
+	if (table->sh_offset > e->size || table->sh_size > e->size - table->sh_offset || offset >= table->sh_size)
+		return NULL;
+	const char *s = (const char*)e->file + table->sh_offset + offset;
+	return memchr(s, '\0', table->sh_size - offset) ? s : NULL;
+}
+
+/**< @return name of the section 'sh', "" if it is invalid */
+static const char *elf_section_name(const elf_t *e, const Elf64_Shdr *sh)
+{
+	const char *name = elf_string(e, e->names, sh->sh_name);
+	return name ? name : "";
+}
+
+/**< find the contents of 'length' bytes at 'address' once loaded
+ * @return pointer into the file, NULL if they are not in the file */
+static const void *elf_address(const elf_t *e, uint64_t address, size_t length)
+{
+	for (size_t i = 0; i < e->eh->e_shnum; i++) {
+		const Elf64_Shdr *sh = &e->sh[i];
+		if (sh->sh_type != SHT_PROGBITS || !(sh->sh_flags & SHF_ALLOC)
+				|| address < sh->sh_addr || address - sh->sh_addr > sh->sh_size || length > sh->sh_size - (address - sh->sh_addr))
+			continue;
+		if (sh->sh_offset > e->size || sh->sh_size > e->size - sh->sh_offset)
+			return NULL;
+		return e->file + sh->sh_offset + (address - sh->sh_addr);
+	}
+	return NULL;
+}
+
+/**< find the string at 'address' once loaded
+ * @return pointer into the file, NULL if it is not in the file or is not
+ * terminated within its section */
+static const char *elf_string_at(const elf_t *e, uint64_t address)
+{
+	for (size_t i = 0; i < e->eh->e_shnum; i++) {
+		const Elf64_Shdr *sh = &e->sh[i];
+		if (sh->sh_type != SHT_PROGBITS || !(sh->sh_flags & SHF_ALLOC)
+				|| address < sh->sh_addr || address - sh->sh_addr >= sh->sh_size)
+			continue;
+		if (sh->sh_offset > e->size || sh->sh_size > e->size - sh->sh_offset)
+			return NULL;
+		const char *s = (const char*)e->file + sh->sh_offset + (address - sh->sh_addr);
+		return memchr(s, '\0', sh->sh_size - (address - sh->sh_addr)) ? s : NULL;
+	}
+	return NULL;
+}
+
+/**< read the pointer at 'address', position independent executables may
+ * only hold it in a relative relocation rather than in place */
+static uint64_t elf_pointer(const elf_t *e, uint64_t address)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < e->eh->e_shnum; i++) {
+		const Elf64_Shdr *sh = &e->sh[i];
+		if (sh->sh_type != SHT_RELA || sh->sh_entsize != sizeof (Elf64_Rela)
+				|| sh->sh_offset > e->size || sh->sh_size > e->size - sh->sh_offset)
+			continue;
+		const Elf64_Rela *r = (const Elf64_Rela*)(e->file + sh->sh_offset);
+		for (size_t j = 0; j < sh->sh_size / sizeof *r; j++)
+			if (r[j].r_offset == address && ELF64_R_TYPE(r[j].r_info) == ELF_RELATIVE)
+				return r[j].r_addend;
+	}
+	const void *p = elf_address(e, address, sizeof value);
+	if (p)
+		memcpy(&value, p, sizeof value);
+	return value;
+}
+
+/**< is this a section holding NVRAM variables */
+static bool elf_nvram_section(const elf_t *e, const Elf64_Shdr *sh)
+{
+	const char *name = elf_section_name(e, sh);
+	return !strncmp(name, "nvram", 5) && strcmp(name, "nvram_layout") && strcmp(name, "nvram_sections")
+		&& sh->sh_type == SHT_PROGBITS && (sh->sh_flags & SHF_ALLOC);
+}
+
+static int symbol_compare(const void *a, const void *b)
+{
+	const nvram_symbol_t *x = a, *y = b;
+	return (x->address > y->address) - (x->address < y->address);
+}
+
+/**< Find the variables in the NVRAM sections of an executable from its
+ * symbol table, the descriptors in 'nvram_layout' (which hold the address of
+ * each variable they describe) give their types. 'symbols' is sorted by
+ * address and must be freed by the caller.
+ * @return number of variables, 0< on failure */
+static long elf_symbols(const elf_t *e, nvram_symbol_t **symbols)
+{
+	long n = 0;
+	const Elf64_Shdr *symtab = NULL, *layout = NULL;
+	assert(e);
+	assert(symbols);
+	*symbols = NULL;
+	for (size_t i = 0; i < e->eh->e_shnum; i++) {
+		if (e->sh[i].sh_type == SHT_SYMTAB)
+			symtab = &e->sh[i];
+		if (!strcmp(elf_section_name(e, &e->sh[i]), "nvram_layout"))
+			layout = &e->sh[i];
+	}
+	if (!symtab || symtab->sh_link >= e->eh->e_shnum || symtab->sh_offset > e->size || symtab->sh_size > e->size - symtab->sh_offset) {
+		fputs("no symbol table, has the executable been stripped?\n", stderr);
+		return -1;
+	}
+	const Elf64_Sym *sym = (const Elf64_Sym*)(e->file + symtab->sh_offset);
+	const Elf64_Shdr *strings = &e->sh[symtab->sh_link];
+	const size_t count = symtab->sh_size / sizeof *sym;
+	if (!(*symbols = calloc(count + 1, sizeof **symbols)))
+		return -1;
+	for (size_t i = 0; i < count; i++) {
+		if (ELF64_ST_TYPE(sym[i].st_info) != STT_OBJECT || sym[i].st_shndx == SHN_UNDEF || sym[i].st_shndx >= e->eh->e_shnum)
+			continue;
+		const Elf64_Shdr *sh = &e->sh[sym[i].st_shndx];
+		const char *name = elf_string(e, strings, sym[i].st_name);
+		if (!name || !elf_nvram_section(e, sh))
+			continue;
+		nvram_symbol_t *s = &(*symbols)[n++];
+		s->section = elf_section_name(e, sh);
+		s->address = sym[i].st_value;
+		s->field.offset = sym[i].st_value - sh->sh_addr;
+		s->field.size   = sym[i].st_size;
+		s->field.type   = NVRAM_T_BLOB;
+		snprintf(s->field.name, sizeof s->field.name, "%s", name);
+	}
+	/* each descriptor is a name, an address, a size and a type; two pointers and two uint32_t */
+	const size_t descriptor = 2 * sizeof (uint64_t) + 2 * sizeof (uint32_t);
+	for (size_t at = 0; layout && at + descriptor <= layout->sh_size; at += descriptor) {
+		const uint64_t address = elf_pointer(e, layout->sh_addr + at + sizeof (uint64_t));
+		const char *name = elf_string_at(e, elf_pointer(e, layout->sh_addr + at));
+		uint32_t size_type[2] = { 0, 0 };
+		const void *p = elf_address(e, layout->sh_addr + at + 2 * sizeof (uint64_t), sizeof size_type);
+		if (p)
+			memcpy(size_type, p, sizeof size_type);
+		for (long i = 0; i < n; i++) {
+			nvram_symbol_t *s = &(*symbols)[i];
+			if (s->address != address || s->field.size != size_type[0])
+				continue;
+			s->described = true;
+			s->field.type = size_type[1];
+			snprintf(s->described_name, sizeof s->described_name, "%s", name ? name : s->field.name);
+		}
+	}
+	qsort(*symbols, n, sizeof **symbols, symbol_compare);
+	return n;
+}
+
+/**< compute the hash of the layout of 'section' as 'nvram.c' would, from
+ * the variables that have descriptors */
+static uint32_t elf_layout_hash(const nvram_symbol_t *symbols, long count, const char *section)
+{
+	uint32_t crc = 0;
+	for (long i = 0; i < count; i++) {
+		if (!symbols[i].described || strcmp(symbols[i].section, section))
+			continue;
+		nvram_field_t f = symbols[i].field;
+		memset(f.name, 0, sizeof f.name);
+		strcpy(f.name, symbols[i].described_name);
+		crc = nvram_crc32c(crc, &f, sizeof f);
+	}
+	return crc;
+}
+
+/* ======= ELF Layout ====================================================== */
+
+/* ======= Inspector ======================================================= */
+
+static const char *type_name(uint32_t type)
+{
+	static const char *names[] = {
+		"blob", "u8", "i8", "u16", "i16", "u32", "i32", "u64", "i64", "f32", "f64",
+	};
+	return type < sizeof names / sizeof names[0] ? names[type] : "?";
+}
+
+/**< print the variables in 'names', or all of them if there are none */
+static int inspect(const nvram_image_t *im, char **names, int count)
+{
+	nvram_field_t f;
+	const nvram_header_t *h = &im->header;
+	if (!count) {
+		printf("%s: generation %"PRIu64", %"PRIu64" bytes, %"PRIu32" variables, layout %08"PRIx32", journal lsn %"PRIu64"\n",
+				im->name, h->generation, h->length, h->count, h->layout, h->lsn);
+		for (uint32_t i = 0; i < h->count; i++) {
+			nvram_image_field(im, i, &f);
+			printf("\t%-16s %-4s %6"PRIu64" %4"PRIu32"  ", f.name, type_name(f.type), f.offset, f.size);
+			if (f.type == NVRAM_T_BLOB && f.size > 32) /* arenas, tables and the like */
+				fputs("(print with -n)", stdout);
+			else if (nvram_image_print(stdout, im, &f) < 0)
+				return -1;
+			putchar('\n');
+		}
+		return 0;
+	}
+	int r = 0;
+	for (int i = 0; i < count; i++) {
+		if (!nvram_image_find(im, names[i], &f)) {
+			fprintf(stderr, "%s: no variable '%s'\n", im->name, names[i]);
+			r = -1;
+			continue;
+		}
+		printf("%s %s ", im->name, f.name);
+		if (nvram_image_print(stdout, im, &f) < 0)
+			return -1;
+		putchar('\n');
+	}
+	return r;
+}
+
+/**< print the variables found in an executable, by section */
+static void layout(const nvram_symbol_t *symbols, long count)
+{
+	for (long i = 0; i < count; i++) {
+		const nvram_field_t *f = &symbols[i].field;
+		if (!i || strcmp(symbols[i].section, symbols[i - 1].section))
+			printf("%s: layout %08"PRIx32"\n", symbols[i].section, elf_layout_hash(symbols, count, symbols[i].section));
+		printf("\t%-16s %-4s %6"PRIu64" %4"PRIu32"%s\n", f->name, type_name(f->type), f->offset, f->size,
+				symbols[i].described ? "" : "  (no descriptor)");
+	}
+}
+
+/**< find the section of the executable an image was written from */
+static const char *section_of(const nvram_image_t *im, const nvram_symbol_t *symbols, long count)
+{
+	for (long i = 0; i < count; i++)
+		if (elf_layout_hash(symbols, count, symbols[i].section) == im->header.layout)
+			return symbols[i].section;
+	return NULL;
+}
+
+static void usage(const char *arg0)
+{
+	fprintf(stderr, "usage: %s [-c] [-e executable] [-n variable]... [-s variable=value]... file...\n"
+			"\t-c\tcheck the image against its checksums\n"
+			"\t-e\tlist the variables in an executable, or say which of its sections each file is from\n"
+			"\t-n\tprint only this variable, on one line per file\n"
+			"\t-s\tset a variable in each file\n", arg0);
+}
+
+int main(int argc, char **argv)
+{
+	int opt = 0, r = 0, count = 0, sets = 0;
+	bool verify = false;
+	const char *executable = NULL;
+	nvram_symbol_t *symbols = NULL;
+	long found = 0;
+	elf_t e = { .file = NULL };
+	char **names = calloc(argc, sizeof *names), **assign = calloc(argc, sizeof *assign);
+	if (!names || !assign)
+		return 1;
+	while ((opt = getopt(argc, argv, "ce:n:s:")) != -1) {
+		switch (opt) {
+		case 'c': verify = true; break;
+		case 'e': executable = optarg; break;
+		case 'n': names[count++] = optarg; break;
+		case 's':
+			if (!strchr(optarg, '=')) {
+				fprintf(stderr, "expected variable=value, got '%s'\n", optarg);
+				r = 1;
+				goto done;
+			}
+			assign[sets++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			r = 1;
+			goto done;
+		}
+	}
+	if (optind >= argc && !executable) {
+		usage(argv[0]);
+		r = 1;
+		goto done;
+	}
+	if (executable) {
+		if (elf_open(&e, executable) < 0 || (found = elf_symbols(&e, &symbols)) < 0) {
+			found = 0;
+			r = 1;
+			goto done;
+		}
+		if (optind >= argc)
+			layout(symbols, found);
+	}
+	for (int i = optind; i < argc; i++) {
+		nvram_image_t im;
+		if (nvram_image_open(&im, argv[i], verify, sets > 0) < 0) {
+			r = 1;
+			continue;
+		}
+		for (int j = 0; j < sets; j++) {
+			nvram_field_t f;
+			char *value = strchr(assign[j], '=');
+			*value = '\0';
+			if (!nvram_image_find(&im, assign[j], &f)) {
+				fprintf(stderr, "%s: no variable '%s'\n", im.name, assign[j]);
+				r = 1;
+			} else if (nvram_image_set(&im, &f, value + 1) < 0) {
+				r = 1;
+			}
+			*value = '=';
+		}
+		if (executable) {
+			const char *section = section_of(&im, symbols, found);
+			printf("%s: %s '%s'\n", im.name, section ? "written from section" : "has a different layout to", section ? section : executable);
+		}
+		if (inspect(&im, names, count) < 0)
+			r = 1;
+		nvram_image_close(&im);
+	}
+done:
+	elf_close(&e);
+	free(symbols);
+	free(names);
+	free(assign);
+	return r;
+}
+
+/* ======= Inspector ======================================================= */
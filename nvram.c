@@ -51,6 +51,55 @@
  * signal is not caught, then the data will not be saved as it is presumably
  * corrupt. The programmer now only has to worry about calling an 
  * initialization function (defined as "nvram_initialize" below).
+ *
+ * For large sections copying the data in and out of the file at startup and
+ * exit becomes expensive. If the section is aligned to a page boundary the
+ * file can instead be mapped directly over the section with "mmap", the
+ * operating system then pages data in on demand and saving becomes a call to
+ * "msync". Only whole pages can be mapped, the partial page at the end of the
+ * section (which is shared with whatever the linker puts after it) is still
+ * copied.
+ *
+ * Saving the entire section on exit is also wasteful when only a few
+ * variables have changed. Write protecting the pages of the section with
+ * "mprotect" causes the first write to each page to fault, a signal handler
+ * can then record the page as dirty and unprotect it, and only the dirty pages
+ * need to be written out when saving. (Linux also offers "soft-dirty" bits in
+ * "/proc/self/pagemap", but they are not available on every kernel.)
+ *
+ * A long running program that is killed never gets to run its "atexit"
+ * handlers, so a thread can also be started to save the section periodically.
+ * Threads updating NVRAM variables hold a lock whilst doing so, the
+ * checkpoint thread takes the lock only for as long as it takes to copy the
+ * modified pages into a snapshot, which is then written out without the lock
+ * held.
+ *
+ * For very large sections even copying the data can take too long, "fork"
+ * can be used instead to get a snapshot, the child process gets a copy of
+ * the section that the kernel shares with the parent until one of them writes
+ * to it, the child writes out the section and exits whilst the parent carries
+ * on.
+ *
+ * A mapped file can also be mapped by other processes, so they can watch the
+ * variables change. Readers have to be able to tell when they have read a
+ * variable half way through an update, a sequence number (a "seqlock") kept
+ * in a shared header is made odd by the writer before an update and even
+ * after it, and a reader retries a copy if the number was odd or changed.
+ *
+ * Variables with different needs can be put in different sections, each
+ * saved to its own file with its own policy, so a small section of frequently
+ * updated counters can be saved often without rewriting a large section of
+ * configuration that rarely changes.
+ *
+ * A program built around an event loop can neither block on a save nor
+ * easily start a thread, on Linux the writes (and the sync) can instead be
+ * queued with io_uring and their completion polled for from the loop.
+ *
+ * Loading or saving a section of several gigabytes with a single thread is
+ * limited by how fast one core can copy and checksum the data, well short of
+ * what the storage and the memory of a large machine can do. As every chunk
+ * has its own checksum the chunks can be split between threads, each reading
+ * and verifying (or checksumming and writing) its own range of them.
  * 
  * This technique has various portability problems and version problems, which
  * can be remedied but require a deeper understanding of a specific toolchain,
@@ -59,12 +108,59 @@
  * Limitations:
  * - The method of course does not work for dynamically allocated variables,
  *   only for variables of a static storage duration. It must be known at
- *   compile time the size of the data structures to be stored.
+ *   compile time the size of the data structures to be stored. An NVRAM
+ *   variable can however be used as an arena to allocate memory from, as
+ *   long as it is large enough, and pointers stored in NVRAM can hold an
+ *   offset from themselves rather than an address, as the section can be
+ *   loaded at a different address each time the program is run.
  *
  * Consistency Problems:
- * - The program below may fail only do a partial update or load, these
- *   consistency problems can be solved in code, but are not needed for a
- *   simple demonstration.
+ * - Opening the file for writing truncates it, so a crash during a save would
+ *   leave a short file. Instead the data is written to a temporary file,
+ *   synced to disk, and renamed over the old file (rename is atomic), the
+ *   directory containing the file is then synced so the rename is durable.
+ *   Callers that can tolerate losing the last save (but not a corrupt file)
+ *   can skip the directory sync.
+ * - Alternatively, as is often done with EEPROM, the file can hold two copies
+ *   of the data (slots "A" and "B"), each with a header holding a checksum
+ *   and a generation number. Saves overwrite the older slot and write its
+ *   header last, loading picks the newest slot with a valid checksum. No
+ *   file needs renaming so saves can be frequent and cheap.
+ * - Files without slots have the same header appended to the data as a
+ *   trailer, so corruption is detected on load and the defaults used
+ *   instead. The checksum (CRC-32C) uses the SSE4.2 "crc32" instruction where
+ *   available, which is fast enough that verifying large files costs little
+ *   more than reading them.
+ * - Each page of data has its own checksum, stored in a table after the data,
+ *   so that a save only has to checksum the pages that changed. This also
+ *   allows verification of each page to be deferred until it is first used,
+ *   by making the pages inaccessible and checking each one in the fault
+ *   handler (a corrupt page aborts the program).
+ * - Going further, the whole pages of an image can be privately mapped from
+ *   the file rather than read, so loading takes the same time whatever the
+ *   size of the section and pages are only read from disk when first used.
+ *   Writes to a privately mapped page go to a copy of it in memory, leaving
+ *   the file as it is until the section is saved.
+ * - Sections are often mostly zeros or default values, which compress well.
+ *   Each chunk is compressed on its own, so a chunk can be decompressed (and
+ *   checked) without the others, and only the chunks that changed need to be
+ *   compressed again. The header records whether the image is compressed.
+ * - Saving the whole section is too much work for a single small update
+ *   that must be durable. Instead each update can be appended as a record
+ *   (offset, length and bytes, with a sequence number and checksum) to a
+ *   write-ahead log, or journal, and only the log synced. Records buffered
+ *   by several updates (or threads) are written with a single write and
+ *   sync. On load the records newer than the image are replayed, and saving
+ *   the image compacts the log by dropping the records it includes.
+ * - When many threads each need their update to be durable, one of them
+ *   (the leader) can wait a short while for the others to append their
+ *   records and then write and sync them all, the others just wait for it.
+ *   This is group commit, it trades a little latency for far fewer syncs.
+ * - A save replaces the previous image, which may be the one that is needed
+ *   if a bad value was saved. The exclusive or of the new image and the one
+ *   before it is mostly zeros, so it is cheap to keep as runs of differing
+ *   words in a history file, and applying it to the new image gives back
+ *   the old one.
  *
  * Portability Problems:
  * - The alignment between variables stored in a section needs to be
@@ -91,6 +187,12 @@
  *   the size of the section used to store the NVRAM variables, and perhaps a
  *   version number. If either of these does not matched the stored data the
  *   data would have to be regenerated.
+ * - Each variable can be described with 'NVRAM_LAYOUT', which puts its name,
+ *   address, size and type into a second section called 'nvram_layout'. A
+ *   table of these descriptors is stored after the image along with its
+ *   hash, an image with a different layout is migrated on load: fields
+ *   are matched by name, copied if their size and type are unchanged, and
+ *   new or changed fields keep their defaults.
  *
  * https://gcc.gnu.org/onlinedocs/gcc-4.0.4/gcc/Type-Attributes.html
  * https://stackoverflow.com/questions/16751378
@@ -98,6 +200,7 @@
  *
  */
 
+#define _GNU_SOURCE /* for mremap and CPU affinity */
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -106,128 +209,3832 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define NVRAM_URING /**< asynchronous saves can use io_uring */
+#endif
+#endif
+#include "nvram.h"
+#include "nvram_codec.h"
 
 /* ======= NVRAM Setup ===================================================== */
 
-const  char *nvram_name = "nvram.blk";          /**< file to store NVRAM variables in */
-extern char __start_nvram;                      /**< start of section 'nvram' */
-extern char __stop_nvram;                       /**< end   of section 'nvram' */
-#define NVRAM volatile __attribute__((section("nvram"))) __attribute__ ((aligned (8))) /**< used to put a variable in 'NVRAM' */
+#define NVRAM_IN(SECTION) volatile __attribute__((section(#SECTION))) __attribute__ ((aligned (8))) /**< used to put a variable in the NVRAM section 'SECTION' */
+#define NVRAM NVRAM_IN(nvram)                   /**< used to put a variable in 'NVRAM', the default section */
+#define NVRAM_PAGE_ALIGNED __attribute__ ((aligned (NVRAM_PAGE))) /**< used on the first NVRAM variable to page align 'NVRAM' */
+
+/**< Layout descriptor for an NVRAM variable, created with 'NVRAM_LAYOUT' and
+ * placed in the section 'nvram_layout', so that the variables can be found at
+ * run time (and by tools reading the executable) without parsing the source */
+typedef struct {
+	const char *name;              /**< name of the variable */
+	const volatile void *address;  /**< address of the variable, within its section */
+	uint32_t size;                 /**< size of the variable in bytes */
+	uint32_t type;                 /**< an nvram_type_e */
+} nvram_layout_t;
+
+extern const nvram_layout_t __start_nvram_layout[]; /**< start of section 'nvram_layout' */
+extern const nvram_layout_t __stop_nvram_layout[];  /**< end   of section 'nvram_layout' */
+
+#define NVRAM_TYPE(VAR) _Generic((VAR),\
+	uint8_t:  NVRAM_T_U8,  int8_t:  NVRAM_T_I8,\
+	uint16_t: NVRAM_T_U16, int16_t: NVRAM_T_I16,\
+	uint32_t: NVRAM_T_U32, int32_t: NVRAM_T_I32,\
+	uint64_t: NVRAM_T_U64, int64_t: NVRAM_T_I64,\
+	float:    NVRAM_T_F32, double:  NVRAM_T_F64,\
+	default:  NVRAM_T_BLOB) /**< type tag for an NVRAM variable */
+
+/**< describe the NVRAM variable 'VAR', this should follow its definition */
+#define NVRAM_LAYOUT(VAR) \
+	static const nvram_layout_t nvram_layout_ ## VAR \
+	__attribute__((section("nvram_layout"), used, aligned(8))) = \
+	{ .name = #VAR, .address = &(VAR), .size = sizeof (VAR), .type = NVRAM_TYPE(VAR) }
+
+/**< when the checksums of a loaded image are checked against its data */
+typedef enum {
+	NVRAM_VERIFY_LOAD,  /**< check every chunk as the image is loaded */
+	NVRAM_VERIFY_DEFER, /**< check each whole page when it is first used, the partial last page on load */
+	NVRAM_VERIFY_NONE,  /**< trust the data, only the header and the table of checksums are checked */
+} nvram_verify_e;
+
+/**< durability of a save, each level is slower than the last */
+typedef enum {
+	NVRAM_DURABLE_NONE, /**< do not sync, tracked sections are updated in place, a crash can leave a partial file */
+	NVRAM_DURABLE_FAST, /**< write a temporary file, sync and rename it over the old one, a crash leaves either version */
+	NVRAM_DURABLE_FULL, /**< as NVRAM_DURABLE_FAST and also sync the directory, so the rename itself is durable */
+} nvram_durability_e;
+
+#define NVRAM_WAL_LIMIT (1u << 20)              /**< journal size at which the checkpointer is asked to compact it */
+
+/**< results of the last background save */
+typedef struct {
+	double pause;       /**< seconds the caller was stopped for whilst forking */
+	double write;       /**< seconds the child took to write the snapshot */
+	double total;       /**< seconds from starting the save to noticing it had finished */
+	int status;         /**< 0 on success, non zero on failure */
+	uint64_t lsn;       /**< last journal record included in the save in progress */
+	unsigned long saves, failures; /**< number of background saves completed and failed */
+} nvram_bgsave_t;
+
+/**< statistics for journal commits */
+typedef struct {
+	unsigned long commits;  /**< calls to 'nvram_wal_commit' that had to wait for a write */
+	double latency;         /**< total seconds those calls waited */
+	double worst;           /**< longest any of them waited */
+	unsigned long batches;  /**< writes (and syncs) of the journal */
+	unsigned long records;  /**< records written by them */
+	unsigned long largest;  /**< most records written in one batch */
+	unsigned long failures; /**< batches that failed to be written */
+} nvram_wal_stats_t;
+
+#define NVRAM_ASYNC_CHUNK (1u << 20) /**< largest write submitted by an asynchronous save */
+#define NVRAM_ASYNC_DEPTH (32u)      /**< writes an asynchronous save keeps in flight */
+
+/**< a write of part of a file being saved asynchronously */
+typedef struct {
+	const char *buffer; /**< data to write */
+	size_t length;      /**< bytes to write */
+	off_t offset;       /**< offset in the file */
+} nvram_io_t;
+
+/**< an io_uring instance, set up by 'nvram_uring_setup' */
+typedef struct {
+	int fd;                                           /**< io_uring file descriptor, -1 if unavailable */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array; /**< submission queue ring */
+	unsigned *cq_head, *cq_tail, *cq_mask;            /**< completion queue ring */
+	void *sqes, *cqes;                                /**< submission and completion queue entries */
+} nvram_uring_t;
+
+/**< state and results of asynchronous saves, see 'nvram_async_save' */
+typedef struct {
+	nvram_uring_t ring;     /**< used to submit the writes, if available */
+	bool probed;            /**< 'ring' has been set up (or found to be unavailable) */
+	bool busy;              /**< a save is in progress, protected by 'save' */
+	bool failed;            /**< a write or sync of the save in progress failed */
+	char *image;            /**< copy of the section being saved */
+	nvram_header_t header;  /**< trailer for 'image', holding the generation it is saved as */
+	uint64_t lsn;           /**< last journal record included in 'image' */
+	nvram_io_t *io;         /**< writes making up the save */
+	size_t count, next, done; /**< writes in 'io', submitted, and finished */
+	unsigned inflight;      /**< requests submitted but not finished */
+	bool sync, synced;      /**< sync submitted, and finished */
+	int fd;                 /**< temporary file being written */
+	char *tmp;              /**< name of the temporary file */
+	struct timespec started; /**< when the save in progress started */
+	double total;           /**< seconds the last save took */
+	unsigned long saves, failures; /**< number of saves completed and failed */
+} nvram_async_t;
+
+#define NVRAM_LIVE_SPINS (1ul << 20)            /**< attempts a reader makes before giving up on a busy writer */
+#define NVRAM_LIVE_YIELD (64ul)                 /**< attempts a reader makes before yielding to a (preempted) writer */
+
+/**< a reader of a shared section in another process, see 'nvram_reader_open' */
+typedef struct {
+	const nvram_live_t *live; /**< live header of the section */
+	const char *image;        /**< whole pages of the section, mapped read only */
+	size_t length;            /**< length of the section */
+	size_t whole;             /**< bytes of the section in 'image' */
+	unsigned long reads;      /**< consistent reads made */
+	unsigned long retries;    /**< reads retried because the writer was updating the section */
+} nvram_reader_t;
+
+/**< NVRAM section state and policy */
+typedef struct {
+	const char *name;   /**< file to store NVRAM variables in */
+	char *start;        /**< start of section */
+	char *stop;         /**< end of section */
+	bool map;           /**< back the section with a shared mapping of 'name' instead of copying */
+	int fd;             /**< file descriptor for 'name' when mapped, -1 otherwise */
+	size_t mapped;      /**< number of bytes from 'start' that are mapped */
+	bool open;          /**< the mapped file is in use, its trailer is written with NVRAM_OPEN_MAGIC */
+	bool track;         /**< only write pages modified since the last save */
+	size_t pages;       /**< number of whole pages write protected for tracking */
+	volatile unsigned char *dirty; /**< one entry per tracked page, non zero if written to */
+	unsigned char *changed;        /**< pages taken from 'dirty' by the save in progress */
+	nvram_durability_e durability; /**< how hard to try to make a save survive a crash */
+	pthread_mutex_t lock;          /**< held when updating variables, so checkpoints see consistent data */
+	pthread_mutex_t save;          /**< serializes saves */
+	unsigned interval;             /**< checkpoint interval in milliseconds */
+	size_t threshold;              /**< dirty pages needed before a (tracked) section is checkpointed */
+	char *snapshot;                /**< copy of the section taken by the checkpointer */
+	pthread_t checkpointer;        /**< thread periodically saving the section */
+	pthread_mutex_t control;       /**< protects 'running' */
+	pthread_cond_t wake;           /**< signaled to stop the checkpointer */
+	bool running;                  /**< true whilst the checkpointer should keep running */
+	pid_t child;                   /**< process performing a background save, 0 if none */
+	int report;                    /**< pipe the child reports its result on */
+	struct timespec forked;        /**< when the background save was started */
+	nvram_bgsave_t bgsave;         /**< statistics for background saves */
+	bool ab;                       /**< alternate saves between two slots, each with a checksummed header */
+	unsigned slot;                 /**< slot holding the newest image */
+	uint64_t generation;           /**< generation of the newest image, 0 if there is no valid slot */
+	unsigned char *prev;           /**< pages changed by the previous save, which the older slot lacks */
+	size_t chunks;                 /**< number of chunks (pages, the last one partial) in the image */
+	uint32_t *crcs;                /**< CRC-32C of each chunk of the image last saved */
+	bool rehash;                   /**< 'crcs' is out of date and every chunk needs checksumming */
+	nvram_verify_e verify;         /**< when the data of a loaded image is checked */
+	bool lazy;                     /**< privately map the whole pages of the image instead of reading them */
+	bool direct;                   /**< bypass the page cache (O_DIRECT) when saving or loading whole images */
+	volatile unsigned char *unverified; /**< pages loaded but not yet checked against 'crcs' */
+	size_t lazy_mapped;            /**< bytes of the section privately mapped from the file */
+	uint32_t layout;               /**< hash of the layout of the variables in the section */
+	nvram_field_t *fields;         /**< layout of the variables in the section, sorted by offset */
+	uint32_t count;                /**< number of fields */
+	bool journal;                  /**< log updates to 'wal_name' with 'nvram_wal_append' */
+	const char *wal_name;          /**< journal of updates since the image was saved */
+	int wal;                       /**< file descriptor for 'wal_name', -1 if not open */
+	pthread_mutex_t wal_lock;      /**< protects the journal state below that is not protected by 'lock' */
+	pthread_cond_t wal_done;       /**< broadcast when a batch of records has been written, uses CLOCK_MONOTONIC */
+	bool flushing;                 /**< a leader is gathering or writing a batch */
+	unsigned window;               /**< microseconds a leader waits for more records before writing */
+	uint64_t failed;               /**< last record of the last batch that could not be written */
+	unsigned long flushes;         /**< batches attempted */
+	nvram_wal_stats_t wal_stats;   /**< journal commit statistics */
+	uint64_t lsn;                  /**< last record appended, protected by 'lock' */
+	uint64_t durable;              /**< last record written (and synced) to the journal */
+	uint64_t image_lsn;            /**< last record included in the image being saved or loaded */
+	char *pending;                 /**< records appended but not yet written, protected by 'lock' */
+	size_t used, capacity;         /**< bytes used and allocated in 'pending' */
+	off_t wal_size;                /**< bytes written to the journal */
+	size_t wal_limit;              /**< journal size at which compaction is requested */
+	bool compact;                  /**< compaction requested, protected by 'control' */
+	nvram_async_t async;           /**< asynchronous save in progress */
+	bool shared;                   /**< map the section and publish it to readers in other processes, implies 'map' */
+	const char *live_name;         /**< file holding the live header of a shared section */
+	nvram_live_t *live;            /**< live header, mapped from 'live_name', NULL if not shared */
+	unsigned keep;                 /**< earlier images that can be rolled back to with 'history_name', 0 for none */
+	unsigned rollback;             /**< images to roll back by when loading */
+	const char *history_name;      /**< differences between the last images saved */
+	char *base;                    /**< copy of the image last saved, NULL if it is not known */
+	uint64_t *delta;               /**< differences between 'base' and the image being saved */
+	size_t delta_used, delta_capacity; /**< words used and allocated in 'delta' */
+	off_t history_size;            /**< bytes of valid records in the history */
+	unsigned deltas;               /**< records in the history */
+	bool compress;                 /**< compress each chunk of the image when saving */
+	uint32_t *sizes;               /**< compressed size of each chunk in 'packs', 0 if it needs compressing */
+	unsigned char *packs;          /**< the compressed form of each chunk, NVRAM_PAGE bytes apart */
+	unsigned char *packed;         /**< the compressed image being saved, see nvram_codec_e */
+	size_t packed_size;            /**< bytes in 'packed' */
+	unsigned threads;              /**< threads loading and saving the image, 0 or 1 for the calling thread alone */
+} nvram_t;
+
+#define NVRAM_PARALLEL (256u) /**< fewest chunks (1 MiB) worth giving a thread of their own */
+#define NVRAM_NODES    (64u)  /**< most NUMA nodes threads are spread over */
+
+/**< Chunks 'first' to 'last' of an image, processed by one of the threads
+ * started by 'parallel'. Each thread is given a copy of the job with its own
+ * range of chunks, everything else is shared. */
+typedef struct nvram_work {
+	int (*run)(struct nvram_work *w); /**< process the chunks, 0 on success */
+	nvram_t *nv;            /**< section the image is of, if it matters */
+	char *image;            /**< image being loaded or saved */
+	size_t length;          /**< bytes in 'image' */
+	size_t first, last;     /**< chunks to process */
+	int fd;                 /**< file to read from or write to, -1 for neither */
+	int direct;             /**< O_DIRECT descriptor for the same file, or -1 */
+	off_t offset;           /**< offset of the image in the file */
+	size_t skip;            /**< bytes at the start of the image that are not read */
+	const uint32_t *crcs;   /**< checksums to verify the chunks against, NULL to not verify them */
+	size_t verify;          /**< first chunk to verify */
+	unsigned char *packed;  /**< compressed image (see nvram_codec_e) being read */
+	const size_t *at;       /**< offset of each compressed chunk in 'packed', and of the end of the last */
+	bool keep;              /**< keep the compressed chunks read for the next save of 'nv' */
+	pthread_t thread;       /**< thread processing the chunks */
+	bool started;           /**< 'thread' was started, otherwise the chunks were processed by the caller */
+	int result;             /**< result of 'run' */
+} nvram_work_t;
+
+extern nvram_t *const __start_nvram_sections[]; /**< start of section 'nvram_sections' */
+extern nvram_t *const __stop_nvram_sections[];  /**< end   of section 'nvram_sections' */
+
+/**< Declare the NVRAM section 'SECTION', stored in the file 'FILE' (a string
+ * literal). This defines its state as 'SECTION_section', with the default
+ * policy which can be changed before 'nvram_initialize' is called, and puts
+ * a pointer to it into the section 'nvram_sections' so every section is
+ * loaded and saved. Variables are put in the section with 'NVRAM_IN(SECTION)',
+ * the first of which must be 'NVRAM_PAGE_ALIGNED'. */
+#define NVRAM_SECTION(SECTION, FILE) \
+	extern char __start_ ## SECTION, __stop_ ## SECTION; \
+	static nvram_t SECTION ## _section = {\
+		.name  = FILE,\
+		.start = &__start_ ## SECTION,\
+		.stop  = &__stop_ ## SECTION,\
+		.fd    = -1,\
+		.durability = NVRAM_DURABLE_FULL,\
+		.lock    = PTHREAD_MUTEX_INITIALIZER,\
+		.save    = PTHREAD_MUTEX_INITIALIZER,\
+		.control = PTHREAD_MUTEX_INITIALIZER,\
+		.wal_name  = FILE ".wal",\
+		.wal       = -1,\
+		.wal_lock  = PTHREAD_MUTEX_INITIALIZER,\
+		.wal_limit = NVRAM_WAL_LIMIT,\
+		.async     = { .ring = { .fd = -1 }, .fd = -1 },\
+		.live_name = FILE ".live",\
+		.history_name = FILE ".hist",\
+	};\
+	static nvram_t *const SECTION ## _entry __attribute__((section("nvram_sections"), used)) = &SECTION ## _section
+
+#define NVRAM_ARENA_CLASSES (64u) /**< size classes of an arena, blocks of class 'c' are 2^c bytes */
+#define NVRAM_ARENA_MIN     (4u)  /**< smallest size class used, 16 byte blocks */
+#define NVRAM_BLOCK_TAG     (0x4e564b00u) /**< marks an allocated block, or'ed with its size class */
+
+/**< A self relative pointer, it holds the distance from itself to what it
+ * points to (0 is NULL), so it stays valid wherever the section is loaded,
+ * as long as it points into the same section. See 'nvram_ptr_get' and
+ * 'nvram_ptr_set'. */
+typedef int64_t nvram_ptr_t;
+
+/**< Header of an arena, an NVRAM variable that memory can be allocated from
+ * with 'nvram_alloc', so that dynamically sized data persists as well. The
+ * blocks follow the header, each is a power of two in size and starts with a
+ * 64-bit word holding its size class, blocks that are freed are kept in a
+ * list for their class, new blocks are cut from the unused space at the end.
+ * All offsets are from the start of the arena. */
+typedef struct {
+	uint64_t size;  /**< size of the arena, including this header */
+	uint64_t top;   /**< offset of the unused space at the end of the arena */
+	uint64_t used;  /**< bytes in allocated blocks */
+	uint64_t free[NVRAM_ARENA_CLASSES]; /**< offset of the first free block of each size class, 0 if none */
+} nvram_arena_t;
+
+/**< define an arena called 'NAME' with 'SIZE' bytes for blocks, the
+ * header is 'NAME.arena', for example "static NVRAM NVRAM_ARENA(heap, 4096);" */
+#define NVRAM_ARENA(NAME, SIZE) \
+	union { nvram_arena_t arena; unsigned char bytes[sizeof (nvram_arena_t) + (SIZE)]; } NAME = \
+	{ .arena = { .size = sizeof (nvram_arena_t) + (SIZE), .top = sizeof (nvram_arena_t) } }
+
+#define NVRAM_GROUP (16u)   /**< slots in a group of a map, their control bytes are compared at once */
+#define NVRAM_EMPTY (0x00u) /**< control byte of an empty slot */
+#define NVRAM_TOMB  (0x01u) /**< control byte of a slot whose entry was removed */
+#define NVRAM_FULL  (0x80u) /**< set in the control byte of a used slot, with 7 bits of the hash of its key */
+
+/**< an entry in a map, if the value refers to something in the section it
+ * should be a self relative pointer, entries are never moved */
+typedef struct {
+	uint64_t key;   /**< key of the entry */
+	uint64_t value; /**< value of the entry */
+} nvram_entry_t;
+
+/**< Header of a map, an NVRAM variable holding a hash table with a fixed
+ * number of slots, made with 'NVRAM_MAP'. The slots are split into groups of
+ * NVRAM_GROUP, the header is followed by a control byte for each slot and
+ * then by the entries. A key hashes to a group to start probing from and a
+ * 7-bit tag, the control bytes of a group are compared against the tag all
+ * at once and only the entries whose tag matches are read, probing stops at
+ * the first group with an empty slot. The hash does not depend on where the
+ * map is loaded, and nor do the entries, so a map is usable as soon as it
+ * is loaded. A control byte of zero is an empty slot, so a new map only
+ * needs its number of groups set. */
+typedef struct {
+	uint64_t groups; /**< groups of slots, a power of two */
+	uint64_t count;  /**< entries in the map */
+	uint64_t tombs;  /**< slots whose entry was removed but which cannot be made empty */
+	uint64_t reserved[5];
+} nvram_map_t;
+
+/**< define a map called 'NAME' with 'GROUPS' groups of NVRAM_GROUP slots,
+ * 'GROUPS' must be a power of two, for example "static NVRAM NVRAM_MAP(table, 64);",
+ * it is aligned to a cache line so that no group of control bytes straddles two */
+#define NVRAM_MAP(NAME, GROUPS) \
+	__attribute__((aligned(64))) struct { nvram_map_t map; uint8_t control[(GROUPS) * NVRAM_GROUP]; nvram_entry_t entry[(GROUPS) * NVRAM_GROUP]; } NAME = \
+	{ .map = { .groups = (GROUPS) } }
+
+#define NVRAM_EVENT (48u) /**< largest event kept in a ring, so that each slot fills a cache line */
+
+/**< An event in a ring, it is valid if 'sequence' is the position it was
+ * written at plus one and 'crc' matches, anything else is a slot that was
+ * being written when the section was saved, or that is being written now. */
+typedef struct {
+	uint64_t sequence; /**< position of the event plus one, 0 whilst it is written */
+	uint32_t length;   /**< bytes in 'data' */
+	uint32_t crc;      /**< CRC-32C of 'data' and 'sequence' */
+	unsigned char data[NVRAM_EVENT];
+} nvram_event_t;
+
+/**< Header of a ring, an NVRAM variable made with 'NVRAM_RING' that keeps
+ * the last events added to it, for example a log that is to survive a crash.
+ * Any number of threads can add events with 'nvram_ring_push' without a
+ * lock, each takes a position by atomically incrementing 'head' and then
+ * fills in the slot for it, the oldest event is overwritten. Events only
+ * need to be read after the ring is loaded, or by a thread that can skip
+ * those being written, so rather than a tail each reader keeps its own
+ * position, see 'nvram_ring_next'. */
+typedef struct {
+	uint64_t slots;  /**< number of events the ring holds */
+	uint64_t head;   /**< position of the next event to add, the ring holds those from 'head - slots' */
+	uint64_t torn;   /**< events found to be incomplete when the ring was checked */
+	uint64_t reserved[5];
+} nvram_ring_t;
+
+/**< define a ring called 'NAME' that keeps the last 'SLOTS' events, for
+ * example "static NVRAM NVRAM_RING(log, 256);" */
+#define NVRAM_RING(NAME, SLOTS) \
+	__attribute__((aligned(64))) struct { nvram_ring_t ring; nvram_event_t event[(SLOTS)]; } NAME = \
+	{ .ring = { .slots = (SLOTS) } }
+
+NVRAM_SECTION(nvram, "nvram.blk");       /**< the default section, 'nvram_section', for configuration */
+NVRAM_SECTION(nvram_hot, "hot.blk");     /**< 'nvram_hot_section', small and frequently updated */
 
 /* ======= NVRAM Setup ===================================================== */
 
 /* ======= NVRAM Variables ================================================= */
 
-       NVRAM uint64_t nv_format   = 0xFF4e5652414d00FFuLL; /**< file format _and_ endianess specifier */
+       NVRAM NVRAM_PAGE_ALIGNED uint64_t nv_format = 0xFF4e5652414d00FFuLL; /**< file format _and_ endianess specifier */
        NVRAM uint64_t nv_version  = 1u;        /**< data version number */
 static NVRAM int32_t  nv_a = 0;                /**< example NVRAM variable 'a' */
 static NVRAM int32_t  nv_b = 0;                /**< example NVRAM variable 'b' */
 static NVRAM int32_t  nv_c = 0;                /**< example NVRAM variable 'c' */
-static NVRAM uint64_t nv_count = 0;            /**< this variable is incremented each time the program is run */
+static NVRAM NVRAM_ARENA(nv_arena, 4096);      /**< memory for 'nv_history' */
+static NVRAM nvram_ptr_t nv_history = 0;       /**< list of the values given in previous runs, newest first */
+static NVRAM NVRAM_MAP(nv_seen, 4);           /**< number of times each value of 'a' is in 'nv_history' */
+static NVRAM NVRAM_RING(nv_events, 16);       /**< the last things the program did */
+
+static NVRAM_IN(nvram_hot) NVRAM_PAGE_ALIGNED uint64_t nv_count = 0; /**< this variable is incremented each time the program is run */
+
+NVRAM_LAYOUT(nv_format);
+NVRAM_LAYOUT(nv_version);
+NVRAM_LAYOUT(nv_a);
+NVRAM_LAYOUT(nv_b);
+NVRAM_LAYOUT(nv_c);
+NVRAM_LAYOUT(nv_arena);
+NVRAM_LAYOUT(nv_history);
+NVRAM_LAYOUT(nv_seen);
+NVRAM_LAYOUT(nv_events);
+NVRAM_LAYOUT(nv_count);
 
 /* ======= NVRAM Variables ================================================= */
 
 /* ======= Utility Functions =============================================== */
 
-/**< Transfer a block of memory to (read = false) or from (read = true) disk  */
-static int block(char *buffer, size_t length, const char *name, bool read)
+/**< write all of 'length' bytes from 'buffer' to 'fd' at 'offset' */
+static int write_all(int fd, const char *buffer, size_t length, off_t offset)
 {
-	FILE *l = NULL;
-	size_t r = 0;
-	assert(buffer);
-	assert(name);
+	while (length) {
+		const ssize_t r = pwrite(fd, buffer, length, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buffer += r, length -= r, offset += r;
+	}
+	return 0;
+}
 
+/**< read all of 'length' bytes into 'buffer' from 'fd' at 'offset' */
+static int read_all(int fd, char *buffer, size_t length, off_t offset)
+{
+	while (length) {
+		const ssize_t r = pread(fd, buffer, length, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buffer += r, length -= r, offset += r;
+	}
+	return 0;
+}
+
+/**< create the temporary file for 'commit' to write, '*tmp' is set to its
+ * name which must be passed to 'commit_finish'. The name is unique to the
+ * process and the call, background saves run in another process and an
+ * asynchronous save can be in flight whilst a section is saved normally.
+ * @return file descriptor, 0< on failure */
+static int commit_start(const char *name, char **tmp)
+{
+	static unsigned commits = 0;
+	int fd = -1;
+	assert(name);
+	assert(tmp);
 	errno = 0;
-	l = fopen(name, read ? "rb" : "wb");
-	if (!l) {
-		fprintf(stderr, "block %s from '%s' failed: %s\n", 
-				read ? "load" : "save", 
-				name, 
-				strerror(errno));
+	if (!(*tmp = malloc(strlen(name) + sizeof ".4294967295.4294967295.tmp"))) {
+		fprintf(stderr, "commit to '%s' failed: %s\n", name, strerror(errno));
+		return -1;
+	}
+	sprintf(*tmp, "%s.%u.%u.tmp", name, (unsigned)getpid(), __atomic_fetch_add(&commits, 1, __ATOMIC_RELAXED));
+	if ((fd = open(*tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "commit to '%s' failed: %s\n", name, strerror(errno));
+		free(*tmp);
+		*tmp = NULL;
+	}
+	return fd;
+}
+
+/**< Finish (or, if 'fail' is true, abandon) a commit started with
+ * 'commit_start' once the data has been written to 'fd', which is synced
+ * unless 'synced' is true, closed, and renamed over 'name'. */
+static int commit_finish(const char *name, char *tmp, int fd, nvram_durability_e durability, bool synced, bool fail)
+{
+	const char *slash = strrchr(name, '/');
+	assert(name);
+	assert(tmp);
+	if (fail)
+		goto fail;
+	if (!synced && durability != NVRAM_DURABLE_NONE && fdatasync(fd) < 0)
+		goto fail;
+	if (close(fd) < 0) {
+		fd = -1;
+		goto fail;
+	}
+	fd = -1;
+	if (rename(tmp, name) < 0)
+		goto fail;
+	free(tmp);
+	tmp = NULL;
+
+	if (durability == NVRAM_DURABLE_FULL) {
+		char *dir = slash ? strndup(name, (slash - name) + 1) : strdup(".");
+		if (!dir)
+			goto fail;
+		fd = open(dir, O_RDONLY | O_DIRECTORY);
+		free(dir);
+		if (fd < 0 || fsync(fd) < 0)
+			goto fail;
+		close(fd);
+	}
+	return 0;
+fail:
+	fprintf(stderr, "commit to '%s' failed: %s\n", name, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	if (tmp)
+		unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+/**< Write 'length' bytes to 'offset' in the file, as much of it as is
+ * suitably aligned with the O_DIRECT descriptor '*direct' (which bypasses the
+ * page cache and so has to read straight from 'buffer') and the rest with
+ * 'fd'. If the file system refuses a direct write '*direct' is set to -1
+ * (the caller still has to close it), and everything after that is written
+ * with 'fd'. */
+static int write_direct(int fd, int *direct, const char *buffer, size_t length, off_t offset)
+{
+	assert(direct);
+	if (*direct >= 0 && (uintptr_t)buffer % NVRAM_PAGE == 0 && offset % NVRAM_PAGE == 0 && length >= NVRAM_PAGE) {
+		const size_t aligned = length & ~((size_t)NVRAM_PAGE - 1);
+		if (write_all(*direct, buffer, aligned, offset) == 0) {
+			buffer += aligned, length -= aligned, offset += aligned;
+		} else if (errno == EINVAL) {
+			*direct = -1;
+		} else {
+			return -1;
+		}
+	}
+	return write_all(fd, buffer, length, offset);
+}
+
+static cpu_set_t numa_cpus[NVRAM_NODES]; /**< CPUs of each NUMA node that has any */
+static unsigned numa_nodes;               /**< number of entries in 'numa_cpus' */
+
+/**< read a list of numbers such as "0-3,8,10-11", as used in sysfs, from
+ * the file 'name' into 'set'
+ * @return true if the list was read and is not empty */
+static bool numa_list(const char *name, cpu_set_t *set)
+{
+	unsigned lo = 0, hi = 0;
+	int c = 0;
+	FILE *f = fopen(name, "r");
+	CPU_ZERO(set);
+	if (!f)
+		return false;
+	while (fscanf(f, "%u", &lo) == 1) {
+		hi = lo;
+		if ((c = fgetc(f)) == '-') {
+			if (fscanf(f, "%u", &hi) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		if (c != ',')
+			break;
+	}
+	fclose(f);
+	return CPU_COUNT(set) > 0;
+}
+
+/**< find the CPUs of each online NUMA node, nodes that only have memory are
+ * left out as no thread can run on them */
+static void numa_discover(void)
+{
+	cpu_set_t online;
+	char name[64];
+	if (!numa_list("/sys/devices/system/node/online", &online))
+		return;
+	for (unsigned node = 0; node < CPU_SETSIZE && numa_nodes < NVRAM_NODES; node++) {
+		if (!CPU_ISSET(node, &online))
+			continue;
+		snprintf(name, sizeof name, "/sys/devices/system/node/node%u/cpulist", node);
+		if (numa_list(name, &numa_cpus[numa_nodes]))
+			numa_nodes++;
+	}
+}
+
+static void *parallel_thread(void *arg)
+{
+	nvram_work_t *w = arg;
+	w->result = w->run(w);
+	return NULL;
+}
+
+/**< Split the 'chunks' chunks of 'job' between up to 'threads' threads, each
+ * given at least NVRAM_PARALLEL chunks, so a small image is processed by the
+ * calling thread alone and the cost of starting the threads is only paid
+ * when it is small in comparison. The threads only last for the one job,
+ * which keeps them out of the way of 'fork' and the fault handler.
+ *
+ * On a machine with more than one NUMA node the threads are spread over the
+ * nodes and each only runs on the CPUs of its node. Memory is placed on the
+ * node of the thread that first touches it, so when the image is read into
+ * the section the pages of each range of chunks end up on the node that
+ * read them, and the section as a whole is spread over the memory of every
+ * node instead of filling the node of the thread that called 'parallel'.
+ * @return 0 if every chunk was processed, 0< if any range failed */
+static int parallel(const nvram_work_t *job, size_t chunks, unsigned threads)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	int r = 0;
+	size_t n = chunks / NVRAM_PARALLEL;
+	nvram_work_t *w = NULL;
+	assert(job);
+	n = n < threads ? n : threads;
+	if (n <= 1 || !(w = calloc(n, sizeof *w))) {
+		nvram_work_t all = *job;
+		all.first = 0;
+		all.last = chunks;
+		return all.run(&all) ? -1 : 0;
+	}
+	pthread_once(&once, numa_discover);
+	for (size_t i = 0; i < n; i++) {
+		pthread_attr_t attr;
+		w[i] = *job;
+		w[i].first = (chunks * i) / n;
+		w[i].last  = (chunks * (i + 1)) / n;
+		pthread_attr_init(&attr);
+		if (numa_nodes > 1) /* contiguous ranges on each node */
+			pthread_attr_setaffinity_np(&attr, sizeof numa_cpus[0], &numa_cpus[(i * numa_nodes) / n]);
+		w[i].started = pthread_create(&w[i].thread, &attr, parallel_thread, &w[i]) == 0;
+		pthread_attr_destroy(&attr);
+		if (!w[i].started) /* do it ourselves then */
+			w[i].result = w[i].run(&w[i]);
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (w[i].started)
+			pthread_join(w[i].thread, NULL);
+		if (w[i].result)
+			r = -1;
+	}
+	free(w);
+	return r;
+}
+
+/**< write the chunks of 'w->image' to 'w->offset' in the file, with
+ * 'write_direct' */
+static int parallel_write(nvram_work_t *w)
+{
+	int direct = w->direct; /* shared, so only this range stops using it */
+	const size_t from = w->first * NVRAM_PAGE;
+	const size_t to   = w->last * NVRAM_PAGE < w->length ? w->last * NVRAM_PAGE : w->length;
+	return write_direct(w->fd, &direct, w->image + from, to - from, w->offset + from);
+}
+
+/**< Atomically replace the file 'name' with the 'count' buffers in 'parts',
+ * which are written one after another. The data is written to a temporary file which is synced and then renamed over
+ * 'name', so a crash at any point leaves either the old or the new file intact.
+ * With NVRAM_DURABLE_FULL the directory is synced as well, otherwise the
+ * rename may be lost (leaving the old file) if the system crashes shortly
+ * after. NVRAM_DURABLE_NONE skips syncing entirely. If 'direct' is true the
+ * page aligned parts are written with O_DIRECT, so they do not fill the page
+ * cache, where the file system supports it. Large parts are written by up to
+ * 'threads' threads, see 'parallel'. */
+static int commit(const char *name, const struct iovec *parts, size_t count, nvram_durability_e durability, bool direct, unsigned threads)
+{
+	off_t offset = 0;
+	bool fail = false;
+	char *tmp = NULL;
+	assert(name);
+	assert(parts);
+	const int fd = commit_start(name, &tmp);
+	if (fd < 0)
+		return -1;
+	const int dfd = direct ? open(tmp, O_WRONLY | O_DIRECT) : -1; /* tmpfs refuses O_DIRECT */
+	for (size_t i = 0; i < count && !fail; offset += parts[i++].iov_len) {
+		const nvram_work_t job = {
+			.run = parallel_write, .image = parts[i].iov_base, .length = parts[i].iov_len,
+			.fd = fd, .direct = dfd, .offset = offset,
+		};
+		fail = parallel(&job, (parts[i].iov_len + NVRAM_PAGE - 1) / NVRAM_PAGE, threads) < 0;
+	}
+	if (dfd >= 0)
+		close(dfd);
+	return commit_finish(name, tmp, fd, durability, false, fail);
+}
+
+#ifdef NVRAM_URING
+/**< check that the io_uring instance 'fd' supports the opcodes used here,
+ * kernels before 5.6 have io_uring but not IORING_OP_WRITE, they also lack
+ * IORING_REGISTER_PROBE so the probe fails */
+static bool nvram_uring_probe(int fd)
+{
+	const size_t ops = 256;
+	bool r = false;
+	struct io_uring_probe *p = calloc(1, sizeof *p + (ops * sizeof p->ops[0]));
+	if (p && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p, ops) >= 0)
+		r = IORING_OP_WRITE <= p->last_op && IORING_OP_FSYNC <= p->last_op
+			&& (p->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)
+			&& (p->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED);
+	free(p);
+	return r;
+}
+#endif
+
+/**< Set up an io_uring instance with 'entries' submission queue entries, it
+ * is left unusable ('u->fd' is -1) if the kernel does not support it, or
+ * does not support the writes used here.
+ * @return 0 on success, 0< if io_uring is unavailable */
+static int nvram_uring_setup(nvram_uring_t *u, unsigned entries)
+{
+	assert(u);
+	u->fd = -1;
+#ifdef NVRAM_URING
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	const int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -1;
+	if (!nvram_uring_probe(fd)) {
+		close(fd);
 		return -1;
 	}
+	size_t sq_size = p.sq_off.array + (p.sq_entries * sizeof (unsigned));
+	size_t cq_size = p.cq_off.cqes + (p.cq_entries * sizeof (struct io_uring_cqe));
+	const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, p.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+		close(fd); /* the mappings go with the last reference to the ring */
+		return -1;
+	}
+	u->sq_head  = (unsigned*)(sq + p.sq_off.head);
+	u->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->cq_head  = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes     = cq + p.cq_off.cqes;
+	u->sqes     = sqes;
+	u->fd       = fd;
+	return 0;
+#else
+	(void)entries;
+	return -1;
+#endif
+}
+
+#ifdef NVRAM_URING
+/**< queue a request, which is not submitted until 'nvram_uring_enter' is called
+ * @return false if the submission queue is full */
+static bool nvram_uring_push(nvram_uring_t *u, uint8_t opcode, uint8_t flags, int fd, const void *buffer, size_t length, off_t offset, uint64_t data)
+{
+	const unsigned tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask)
+		return false;
+	const unsigned i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe*)u->sqes + i;
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode    = opcode;
+	sqe->flags     = flags;
+	sqe->fd        = fd;
+	sqe->addr      = (uintptr_t)buffer;
+	sqe->len       = length;
+	sqe->off       = offset;
+	sqe->user_data = data;
+	if (opcode == IORING_OP_FSYNC)
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	u->sq_array[i] = i;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**< submit 'submit' queued requests and, if 'wait' is true, wait for at
+ * least one request to finish */
+static int nvram_uring_enter(nvram_uring_t *u, unsigned submit, bool wait)
+{
+	for (;;) {
+		const long r = syscall(__NR_io_uring_enter, u->fd, submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (r >= 0 || errno != EINTR)
+			return r < 0 ? -1 : 0;
+	}
+}
+
+/**< take a finished request off the completion queue
+ * @return false if there are none */
+static bool nvram_uring_reap(nvram_uring_t *u, uint64_t *data, int *result)
+{
+	const unsigned head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	const struct io_uring_cqe *cqe = (struct io_uring_cqe*)u->cqes + (head & *u->cq_mask);
+	*data   = cqe->user_data;
+	*result = cqe->res;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+#endif
+
+/**< SIGSEGV handler for protected pages in the sections. The first access to
+ * a page that has been loaded but not verified checks its checksum, aborting
+ * the program if it is corrupt, and a write to a write protected page marks it
+ * as dirty and unprotects it so the write can proceed. Any other fault is
+ * passed on to the default handler. */
+static void nvram_fault(int sig, siginfo_t *info, void *context)
+{
+	char *addr = info->si_addr;
+	(void)context;
+	for (nvram_t *const *s = __start_nvram_sections; s < __stop_nvram_sections; s++) {
+		nvram_t *nv = *s;
+		if (addr < nv->start || addr >= nv->start + (nv->pages * NVRAM_PAGE))
+			continue;
+		const size_t page = (addr - nv->start) / NVRAM_PAGE;
+		char *p = nv->start + (page * NVRAM_PAGE);
+		if (nv->unverified && nv->unverified[page]) {
+			static const char corrupt[] = "nvram page corrupt, aborting\n";
+			if (mprotect(p, NVRAM_PAGE, PROT_READ) < 0)
+				goto fail;
+			if (~nvram_crc32c_update(~0u, (const unsigned char*)p, NVRAM_PAGE) != nv->crcs[page]) { /* 'nvram_crc32c' is not async-signal-safe */
+				if (write(STDERR_FILENO, corrupt, sizeof corrupt - 1)) { /* do not care */ }
+				abort();
+			}
+			nv->unverified[page] = 0;
+			if (nv->dirty) /* a write faults again and marks the page dirty */
+				return;
+			if (mprotect(p, NVRAM_PAGE, PROT_READ | PROT_WRITE) == 0)
+				return;
+		} else if (nv->dirty) {
+			/* unprotect the page before marking it dirty; if 'nvram_collect'
+			 * clears the mark and protects the page in between, the write
+			 * faults again, so a writable page is always marked dirty */
+			if (mprotect(p, NVRAM_PAGE, PROT_READ | PROT_WRITE) < 0)
+				goto fail;
+			__atomic_store_n(&nv->dirty[page], 1, __ATOMIC_RELEASE);
+			return;
+		}
+		break;
+	}
+fail:
+	signal(sig, SIG_DFL); /* re-executing the instruction faults again */
+}
+
+/**< install 'nvram_fault' as the handler for access violations */
+static int nvram_catch_faults(void)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_sigaction = nvram_fault;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
 	errno = 0;
-	r = read ? fread(buffer, 1, length, l) : fwrite(buffer, 1, length, l);
-	if (r != length) {
-		fprintf(stderr, "warning - partial block operation "
-				" (%u/%u bytes %s): %s\n", 
-				(unsigned)r, 
-				(unsigned)length, 
-				read ? "read" : "wrote", 
-				strerror(errno));
-		fclose(l);
+	if (sigaction(SIGSEGV, &sa, NULL) < 0 || sigaction(SIGBUS, &sa, NULL) < 0) {
+		fprintf(stderr, "nvram fault handler installation failed: %s\n", strerror(errno));
 		return -1;
 	}
-	fclose(l);
 	return 0;
 }
 
-/**< function to register with atexit, this saves the block to disk */
-static void nvram_save(void)
+/**< verify any pages that have not been accessed since they were loaded, this
+ * must be done before the section is passed to a system call as they fail
+ * with EFAULT instead of faulting */
+static void nvram_settle(nvram_t *nv)
+{
+	assert(nv);
+	for (size_t i = 0; nv->unverified && i < nv->pages; i++)
+		if (nv->unverified[i])
+			(void)*(volatile char*)(nv->start + (i * NVRAM_PAGE));
+}
+
+/**< size of the table of chunk checksums */
+static size_t nvram_table_size(const nvram_t *nv)
+{
+	return nv->chunks * sizeof nv->crcs[0];
+}
+
+/**< size of the table of fields */
+static size_t nvram_fields_size(const nvram_t *nv)
+{
+	return nv->count * sizeof nv->fields[0];
+}
+
+/**< size of a file holding a single image, its tables and a trailer */
+static size_t nvram_file_size(const nvram_t *nv)
+{
+	return (nv->stop - nv->start) + nvram_table_size(nv) + nvram_fields_size(nv) + sizeof (nvram_header_t);
+}
+
+/**< offset of the image for 'slot' within an A/B file, the two slot headers
+ * occupy the first two pages, each slot holds an image and its tables */
+static off_t nvram_slot_offset(const nvram_t *nv, unsigned slot)
+{
+	const size_t pages = ((nv->stop - nv->start) + nvram_table_size(nv) + nvram_fields_size(nv) + NVRAM_PAGE - 1) / NVRAM_PAGE;
+	return (2 + (slot * pages)) * (off_t)NVRAM_PAGE;
+}
+
+/**< checksum the chunks of 'w->image' that changed since the last save */
+static int nvram_work_hash(nvram_work_t *w)
 {
-	fprintf(stderr, "saving nvram to '%s'\n", nvram_name);
-	if (block(&__start_nvram, &__stop_nvram - &__start_nvram, nvram_name, false)) {
-		fprintf(stderr, "nvram block save failed: '%s'\n", nvram_name);
+	nvram_t *nv = w->nv;
+	for (size_t i = w->first; i < w->last; i++) {
+		const size_t offset = i * NVRAM_PAGE;
+		if (!nv->rehash && nv->dirty && i < nv->pages && !nv->changed[i])
+			continue;
+		nv->crcs[i] = nvram_crc32c(0, w->image + offset, w->length - offset < NVRAM_PAGE ? w->length - offset : NVRAM_PAGE);
 	}
+	return 0;
 }
 
-/**< register save call back atexit and load in NVRAM variables
- * @return 0< fatal error, 0 = okay, 1 = warning */
-static int nvram_initialize(void)
+/**< checksum the chunks of 'image' that changed since the last save, which
+ * for a section that is not tracked is all of them */
+static void nvram_hash(nvram_t *nv, const char *image)
 {
-	int r = 0;
-	uint64_t format = nv_format;
-	uint64_t version = nv_version;
+	assert(nv);
+	assert(image);
+	const nvram_work_t job = { .run = nvram_work_hash, .nv = nv, .image = (char*)image, .length = nv->stop - nv->start, .fd = -1, .direct = -1 };
+	parallel(&job, nv->chunks, nv->threads);
+	nv->rehash = false;
+}
 
-	if (block(&__start_nvram, &__stop_nvram - &__start_nvram, nvram_name, true))
-		r = 1;
+/**< allocate the buffers for compressing the section, if not already done */
+static int nvram_pack_alloc(nvram_t *nv)
+{
+	assert(nv);
+	if (nv->packed)
+		return 0;
+	nv->sizes  = calloc(nv->chunks + 1, sizeof nv->sizes[0]);
+	nv->packs  = malloc(nv->chunks * NVRAM_PAGE + 1);
+	nv->packed = malloc(nvram_table_size(nv) + (nv->stop - nv->start) + 1);
+	if (nv->sizes && nv->packs && nv->packed)
+		return 0;
+	fputs("nvram compression allocation failed\n", stderr);
+	free(nv->sizes);
+	free(nv->packs);
+	free(nv->packed);
+	nv->sizes = NULL;
+	nv->packs = nv->packed = NULL;
+	return -1;
+}
 
-	if (format != nv_format) {
-		fprintf(stderr, "file format/endianess incompatibility: expected %"PRIx64 " - actual %"PRIx64"\n", format, nv_version);
+/**< compress the chunks of 'w->image' that changed since the last save into
+ * 'nv->packs', a chunk that does not shrink is stored as it is */
+static int nvram_work_pack(nvram_work_t *w)
+{
+	nvram_t *nv = w->nv;
+	for (size_t i = w->first; i < w->last; i++) {
+		const size_t offset = i * NVRAM_PAGE, n = w->length - offset < NVRAM_PAGE ? w->length - offset : NVRAM_PAGE;
+		unsigned char *pack = nv->packs + offset;
+		if (!nv->rehash && nv->dirty && i < nv->pages && !nv->changed[i] && nv->sizes[i])
+			continue;
+		if (!(nv->sizes[i] = nvram_lz4_compress((const unsigned char*)w->image + offset, n, pack, n - 1))) {
+			memcpy(pack, w->image + offset, n);
+			nv->sizes[i] = n;
+		}
+	}
+	return 0;
+}
+
+/**< Compress 'image' into 'nv->packed' a chunk at a time. The compressed form
+ * of each chunk is kept, so, as with 'nvram_hash', only the chunks that
+ * changed since the last save are compressed again, and they are compressed
+ * in parallel before being gathered into 'nv->packed'.
+ * @return 0 on success (or if the section is not compressed), 0< on failure */
+static int nvram_pack(nvram_t *nv, const char *image)
+{
+	assert(nv);
+	assert(image);
+	if (!nv->compress)
+		return 0;
+	if (nvram_pack_alloc(nv) < 0)
 		return -1;
+	const nvram_work_t job = { .run = nvram_work_pack, .nv = nv, .image = (char*)image, .length = nv->stop - nv->start, .fd = -1, .direct = -1 };
+	parallel(&job, nv->chunks, nv->threads);
+	size_t at = nvram_table_size(nv);
+	for (size_t i = 0; i < nv->chunks; i++) {
+		memcpy(nv->packed + at, nv->packs + (i * NVRAM_PAGE), nv->sizes[i]);
+		at += nv->sizes[i];
 	}
-	if (version != nv_version) {
-		fprintf(stderr, "version incompatibility: expected %"PRIx64 " - actual %"PRIx64"\n", version, nv_version);
+	memcpy(nv->packed, nv->sizes, nvram_table_size(nv));
+	nv->packed_size = at;
+	return 0;
+}
+
+/**< verify the chunks of 'w->image' from 'w->verify' onwards against 'w->crcs' */
+static int nvram_work_check(const nvram_work_t *w)
+{
+	for (size_t i = w->first > w->verify ? w->first : w->verify; w->crcs && i < w->last; i++) {
+		const size_t offset = i * NVRAM_PAGE;
+		if (nvram_crc32c(0, w->image + offset, w->length - offset < NVRAM_PAGE ? w->length - offset : NVRAM_PAGE) != w->crcs[i])
+			return -1;
+	}
+	return 0;
+}
+
+/**< decompress the chunks of 'w->packed' into 'w->image', reading them in
+ * first, and verify them */
+static int nvram_work_unpack(nvram_work_t *w)
+{
+	nvram_t *nv = w->nv;
+	const size_t *at = w->at;
+	if (read_all(w->fd, (char*)w->packed + at[w->first], at[w->last] - at[w->first], w->offset + at[w->first]) < 0)
 		return -1;
+	for (size_t i = w->first; i < w->last; i++) {
+		const size_t offset = i * NVRAM_PAGE, n = w->length - offset < NVRAM_PAGE ? w->length - offset : NVRAM_PAGE;
+		const size_t packs = at[i + 1] - at[i];
+		if (packs == n)
+			memcpy(w->image + offset, w->packed + at[i], n);
+		else if (nvram_lz4_decompress(w->packed + at[i], packs, (unsigned char*)w->image + offset, n) < 0)
+			return -1;
+		if (w->keep) {
+			memcpy(nv->packs + offset, w->packed + at[i], packs);
+			nv->sizes[i] = packs;
+		}
 	}
+	return nvram_work_check(w);
+}
 
-	if (atexit(nvram_save)) {
-		fputs("atexit: failed to register nvram_save\n", stderr);
+/**< Read the compressed image described by 'h' from 'job->fd' and decompress
+ * it into 'job->image', which holds 'h->length' bytes, verifying it as set by
+ * 'job'. The chunks are read and decompressed in parallel once the table of
+ * their sizes is read. The compressed chunks are kept for the next save if
+ * 'job->keep' is set, which is only valid if the image is the section and the
+ * section is compressed too.
+ * @return 0 on success, 0< if the image could not be read or is invalid */
+static int nvram_unpack(nvram_work_t *job, const nvram_header_t *h)
+{
+	nvram_t *nv = job->nv;
+	const size_t chunks = (h->length + NVRAM_PAGE - 1) / NVRAM_PAGE, table = chunks * sizeof (uint32_t);
+	int r = -1;
+	assert(job);
+	assert(h);
+	if (h->codec != NVRAM_CODEC_LZ4 || h->table < h->offset || h->table - h->offset < table)
+		return -1;
+	if (job->keep && nvram_pack_alloc(nv) < 0)
 		return -1;
+	const size_t size = h->table - h->offset;
+	unsigned char *packed = malloc(size + 1);
+	size_t *at = malloc((chunks + 1) * sizeof *at);
+	if (!packed || !at) {
+		fputs("nvram decompression allocation failed\n", stderr);
+		goto done;
 	}
+	if (read_all(job->fd, (char*)packed, table, h->offset) < 0)
+		goto done;
+	at[0] = table;
+	for (size_t i = 0; i < chunks; i++) {
+		const size_t offset = i * NVRAM_PAGE, n = h->length - offset < NVRAM_PAGE ? h->length - offset : NVRAM_PAGE;
+		uint32_t packs = 0;
+		memcpy(&packs, packed + (i * sizeof packs), sizeof packs);
+		if (!packs || packs > n || packs > size - at[i])
+			goto done;
+		at[i + 1] = at[i] + packs;
+	}
+	job->run    = nvram_work_unpack;
+	job->packed = packed;
+	job->at     = at;
+	job->offset = h->offset;
+	r = parallel(job, chunks, nv->threads);
+done:
+	if (r < 0 && job->keep && nv->sizes)
+		memset(nv->sizes, 0, nvram_table_size(nv));
+	free(packed);
+	free(at);
 	return r;
 }
 
-/* ======= Utility Functions =============================================== */
+/**< fill in a header for a new image to be written at 'offset', the chunks
+ * must have been checksummed with 'nvram_hash', and compressed with
+ * 'nvram_pack' if the section is compressed */
+static void nvram_header(const nvram_t *nv, nvram_header_t *h, off_t offset)
+{
+	memset(h, 0, sizeof *h);
+	h->magic      = nv->open ? NVRAM_OPEN_MAGIC : NVRAM_MAGIC;
+	h->generation = nv->generation + 1;
+	h->offset     = offset;
+	h->length     = nv->stop - nv->start;
+	h->table      = offset + (nv->compress ? nv->packed_size : h->length);
+	h->fields     = h->table + nvram_table_size(nv);
+	h->chunk      = NVRAM_PAGE;
+	h->count      = nv->count;
+	h->lsn        = nv->image_lsn;
+	h->table_crc  = nvram_crc32c(0, nv->crcs, nvram_table_size(nv));
+	h->layout     = nv->layout;
+	h->header_crc = nvram_crc32c(0, h, offsetof(nvram_header_t, header_crc));
+	h->codec      = nv->compress ? NVRAM_CODEC_LZ4 : NVRAM_CODEC_NONE;
+}
 
-/* ======= Test Program ==================================================== */
-/* A simple test program for the techniques described above, it prints the
- * default values for NVRAM variables, initializes the NVRAM and registers the
- * save callback, and allows the user to update values which will be saved to
- * disk on exit. */
-int main(void)
+/**< check the magic number and checksum of a header */
+static bool nvram_header_valid(const nvram_header_t *h)
 {
-	/* default values can be accessed before nvram_initialize is called */
-	printf("default a:   %d\n", (int)nv_a);
-	printf("default b:   %d\n", (int)nv_b);
-	printf("default c:   %d\n", (int)nv_c);
+	return (h->magic == NVRAM_MAGIC || h->magic == NVRAM_OPEN_MAGIC)
+		&& h->header_crc == nvram_crc32c(0, h, offsetof(nvram_header_t, header_crc))
+		&& h->chunk == NVRAM_PAGE && h->codec <= NVRAM_CODEC_LZ4;
+}
 
-	/* loads in variables off disk and registers nvram_initialize */
-	if(nvram_initialize() < 0)
+/**< check that the image described by 'h' has the same layout as the
+ * section, so it can be loaded as is instead of being migrated */
+static bool nvram_header_compatible(const nvram_t *nv, const nvram_header_t *h)
+{
+	return h->layout == nv->layout && h->length == (uint64_t)(nv->stop - nv->start);
+}
+
+/**< read and check the trailer of a file of 'size' bytes holding a single image */
+static bool nvram_trailer_read(int fd, off_t size, nvram_header_t *h)
+{
+	assert(h);
+	return size >= (off_t)sizeof *h && pread(fd, h, sizeof *h, size - sizeof *h) == sizeof *h && nvram_header_valid(h) && h->offset == 0;
+}
+
+static int nvram_layout_compare(const void *a, const void *b)
+{
+	const nvram_layout_t *x = *(const nvram_layout_t * const *)a, *y = *(const nvram_layout_t * const *)b;
+	return (x->address > y->address) - (x->address < y->address);
+}
+
+/**< Find the layout descriptors for the variables in the section, sorted by
+ * address, 'layout' must be freed by the caller.
+ * @return number of descriptors, 0< on failure */
+static long nvram_layouts(const nvram_t *nv, const nvram_layout_t ***layout)
+{
+	size_t n = 0;
+	const size_t max = __stop_nvram_layout - __start_nvram_layout;
+	assert(nv);
+	assert(layout);
+	if (!(*layout = malloc((max + 1) * sizeof **layout)))
 		return -1;
+	for (const nvram_layout_t *l = __start_nvram_layout; l < __stop_nvram_layout; l++)
+		if ((const volatile char*)l->address >= nv->start && (const volatile char*)l->address < nv->stop)
+			(*layout)[n++] = l;
+	qsort(*layout, n, sizeof **layout, nvram_layout_compare);
+	return n;
+}
 
-	printf("count:       %u\n", (unsigned)(nv_count++));
-	printf("loaded a:    %d\n", (int)nv_a);
-	printf("loaded b:    %d\n", (int)nv_b);
-	printf("loaded c:    %d\n", (int)nv_c);
+/**< Build the table of fields from the layout descriptors of the variables
+ * in the section, and hash it; a change to the name, offset, size or type of
+ * any of them changes the hash */
+static int nvram_describe(nvram_t *nv)
+{
+	const nvram_layout_t **layout = NULL;
+	const long n = nvram_layouts(nv, &layout);
+	assert(nv);
+	if (n < 0 || !(nv->fields = calloc(n + 1, sizeof nv->fields[0]))) {
+		fputs("nvram layout allocation failed\n", stderr);
+		free(layout);
+		return -1;
+	}
+	for (long i = 0; i < n; i++) {
+		nvram_field_t *f = &nv->fields[i];
+		if (strlen(layout[i]->name) >= sizeof f->name) {
+			fprintf(stderr, "nvram variable name '%s' too long\n", layout[i]->name);
+			free(layout);
+			return -1;
+		}
+		strcpy(f->name, layout[i]->name);
+		f->offset = (const volatile char*)layout[i]->address - nv->start;
+		f->size   = layout[i]->size;
+		f->type   = layout[i]->type;
+	}
+	free(layout);
+	nv->count  = n;
+	nv->layout = nvram_crc32c(0, nv->fields, nvram_fields_size(nv));
+	return 0;
+}
 
-	/* accept some user input and do some calculations */
-	fputs("a new value: ", stdout);
-	scanf("%" SCNd32, &nv_a);
-	fputs("b new value: ", stdout);
-	scanf("%" SCNd32, &nv_b);
-	nv_c = nv_a + nv_b;
-	printf("c = a + b\nc = %d\n", (int)nv_c);
+/**< write the table and trailer to the file 'fd', which holds a single image
+ * at its start, and count the save, the chunks must have been checksummed
+ * with 'nvram_hash' */
+static int nvram_trailer(nvram_t *nv, int fd)
+{
+	nvram_header_t h;
+	nvram_header(nv, &h, 0);
+	if (write_all(fd, (char*)nv->crcs, nvram_table_size(nv), h.table) < 0)
+		return -1;
+	if (write_all(fd, (char*)nv->fields, nvram_fields_size(nv), h.fields) < 0)
+		return -1;
+	if (write_all(fd, (char*)&h, sizeof h, h.fields + nvram_fields_size(nv)) < 0)
+		return -1;
+	nv->generation++;
+	return 0;
+}
+
+/**< Privately map the whole pages of the image at 'offset' in the file 'fd'
+ * onto the section if 'nv->lazy' is set, the pages are copied on write so
+ * the file is left unchanged and can even be replaced by a save. Any previous
+ * mapping is replaced, so it is also used to discard one.
+ * @return 0 on success (or if the section is not lazily loaded), 0< on failure */
+static int nvram_lazy(nvram_t *nv, int fd, off_t offset)
+{
+	const size_t whole = nv->pages * NVRAM_PAGE;
+	assert(nv);
+	nv->lazy_mapped = 0;
+	if (!nv->lazy || !whole)
+		return 0;
+	if (NVRAM_PAGE % sysconf(_SC_PAGESIZE) || (uintptr_t)nv->start % NVRAM_PAGE || offset % NVRAM_PAGE) {
+		fprintf(stderr, "nvram section at %p not aligned for mapping\n", (void*)nv->start);
+		return -1;
+	}
+	errno = 0;
+	if (mmap(nv->start, whole, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+		fprintf(stderr, "nvram lazy mapping of '%s' failed: %s\n", nv->name, strerror(errno));
+		/* the old mapping may be gone, so put back zeroed memory for the defaults */
+		if (mmap(nv->start, whole, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+			abort();
+		return -1;
+	}
+	nv->lazy_mapped = whole;
+	return 0;
+}
+
+/**< Read the chunks of the image at 'w->offset' in the file into 'w->image',
+ * bar the first 'w->skip' bytes, unless 'w->fd' is -1, and verify them. Whole
+ * pages are read with 'w->direct', bypassing the page cache, if it is open. */
+static int nvram_work_read(nvram_work_t *w)
+{
+	size_t from = w->first * NVRAM_PAGE > w->skip ? w->first * NVRAM_PAGE : w->skip;
+	const size_t to = w->last * NVRAM_PAGE < w->length ? w->last * NVRAM_PAGE : w->length;
+	const size_t whole = to & ~((size_t)NVRAM_PAGE - 1);
+	if (w->fd < 0 || from >= to)
+		return nvram_work_check(w);
+	if (w->direct >= 0 && from < whole && read_all(w->direct, w->image + from, whole - from, w->offset + from) == 0)
+		from = whole; /* otherwise read it normally */
+	if (read_all(w->fd, w->image + from, to - from, w->offset + from) < 0)
+		return -1;
+	return nvram_work_check(w);
+}
+
+/**< Check the image described by 'h' in the file 'fd', which may already be
+ * in the section (as it is when mapped), or is read into it if 'read' is
+ * true. The table of chunk checksums is read and checked against the header,
+ * then either every chunk is verified or, if 'nv->verify' is
+ * NVRAM_VERIFY_DEFER and the file is not mapped, the whole pages are made
+ * inaccessible so they are verified on first access instead, or with
+ * NVRAM_VERIFY_NONE not at all. If 'nv->lazy' is set the whole pages are not
+ * read but privately mapped, so they are only read in when first accessed.
+ * Each of up to 'nv->threads' threads reads and verifies a range of chunks.
+ * @return 0 if the image is valid, 1 if it is not */
+static int nvram_verify(nvram_t *nv, int fd, const nvram_header_t *h, bool read)
+{
+	const size_t length = nv->stop - nv->start;
+	const bool defer = nv->verify == NVRAM_VERIFY_DEFER && read;
+	const size_t first = nv->verify == NVRAM_VERIFY_NONE ? nv->chunks : defer ? nv->pages : 0;
+	assert(nv);
+	assert(h);
+	nv->rehash = true;
+	if (pread(fd, nv->crcs, nvram_table_size(nv), h->table) != (ssize_t)nvram_table_size(nv)
+		|| nvram_crc32c(0, nv->crcs, nvram_table_size(nv)) != h->table_crc)
+		return 1;
+	nvram_work_t job = {
+		.run = nvram_work_read, .nv = nv, .image = nv->start, .length = length,
+		.fd = read ? fd : -1, .direct = -1, .offset = h->offset,
+		.crcs = nv->crcs, .verify = first, .keep = nv->compress,
+	};
+	if (read && h->codec) { /* compressed images can only be read in whole */
+		if (nvram_unpack(&job, h) < 0)
+			return 1;
+	} else {
+		if (read && nvram_lazy(nv, fd, h->offset) < 0)
+			return 1;
+		job.skip = nv->lazy_mapped;
+		if (read && nv->direct && !nv->lazy && h->offset % NVRAM_PAGE == 0)
+			job.direct = open(nv->name, O_RDONLY | O_DIRECT); /* tmpfs refuses O_DIRECT, read normally instead */
+		const int r = parallel(&job, nv->chunks, nv->threads);
+		if (job.direct >= 0)
+			close(job.direct);
+		if (r < 0)
+			return 1;
+	}
+	nv->rehash = false;
+	if (!defer || !nv->pages)
+		return 0;
+	if (!nv->unverified && !(nv->unverified = malloc(nv->pages)))
+		return 1;
+	memset((void*)nv->unverified, 1, nv->pages);
+	if (nvram_catch_faults() < 0 || mprotect(nv->start, nv->pages * NVRAM_PAGE, PROT_NONE) < 0) {
+		memset((void*)nv->unverified, 0, nv->pages);
+		mprotect(nv->start, nv->pages * NVRAM_PAGE, PROT_READ | PROT_WRITE);
+		return 1;
+	}
+	return 0;
+}
+
+/**< Migrate the image described by 'h' in the file 'fd', which was written
+ * with a different layout, into the section which must hold the defaults.
+ * Each field of the section is looked up by name in the stored fields and
+ * copied if its size and type are unchanged, fields that are adjacent (bar
+ * alignment padding) in both layouts are copied as a single run. New fields,
+ * and those that changed, keep their defaults.
+ * @return 0 on success, 1 if the image is corrupt, 0< on failure */
+static int nvram_migrate(nvram_t *nv, int fd, const nvram_header_t *h)
+{
+	int r = 1;
+	const size_t chunks = (h->length + NVRAM_PAGE - 1) / NVRAM_PAGE;
+	const size_t table  = chunks * sizeof (uint32_t);
+	const size_t fields = h->count * sizeof (nvram_field_t);
+	size_t to = 0, from = 0, size = 0, kept = 0, runs = 0;
+	char *image = malloc(h->length + 1);
+	uint32_t *crcs = malloc(table + 1);
+	nvram_field_t *old = malloc(fields + 1);
+	assert(nv);
+	assert(h);
+
+	if (!image || !crcs || !old) {
+		fputs("nvram migration allocation failed\n", stderr);
+		r = -1;
+		goto done;
+	}
+	if (pread(fd, crcs, table, h->table) != (ssize_t)table || nvram_crc32c(0, crcs, table) != h->table_crc)
+		goto done;
+	if (pread(fd, old, fields, h->fields) != (ssize_t)fields || nvram_crc32c(0, old, fields) != h->layout)
+		goto done;
+	nvram_work_t job = {
+		.run = nvram_work_read, .nv = nv, .image = image, .length = h->length,
+		.fd = fd, .direct = -1, .offset = h->offset, .crcs = crcs,
+	};
+	if (h->codec ? nvram_unpack(&job, h) < 0 : parallel(&job, chunks, nv->threads) < 0)
+		goto done;
+
+	for (uint32_t i = 0; i <= nv->count; i++) { /* one extra pass to flush the last run */
+		const nvram_field_t *f = i < nv->count ? &nv->fields[i] : NULL, *o = NULL;
+		for (uint32_t j = 0; f && !o && j < h->count; j++)
+			if (!strncmp(old[j].name, f->name, sizeof f->name) && old[j].size == f->size
+					&& old[j].type == f->type && old[j].offset + old[j].size <= h->length)
+				o = &old[j];
+		if (o && size && f->offset >= to + size && f->offset - (to + size) < 8 && o->offset - from == f->offset - to) {
+			size = (f->offset + f->size) - to;
+			kept++;
+			continue;
+		}
+		if (size) {
+			memcpy(nv->start + to, image + from, size);
+			runs++;
+		}
+		size = 0;
+		if (o) {
+			to   = f->offset;
+			from = o->offset;
+			size = f->size;
+			kept++;
+		}
+	}
+	fprintf(stderr, "nvram migrated '%s': kept %zu of %"PRIu32" fields in %zu runs\n", nv->name, kept, nv->count, runs);
+	nv->rehash = true;
+	r = 0;
+done:
+	free(image);
+	free(crcs);
+	free(old);
+	return r;
+}
+
+/**< Load a file holding a single image followed by its trailer into the
+ * section, the checksum is verified and the default values restored from
+ * 'defaults' if it does not match. An image with a different layout is
+ * migrated. A file without a trailer that is exactly the size of the section
+ * is loaded as is, older versions of this program did not checksum the data.
+ * @return 0 on success, 1 if no valid data was found or it was migrated */
+static int nvram_load_image(nvram_t *nv, const char *defaults)
+{
+	int fd = -1, r = 1;
+	nvram_header_t h;
+	struct stat s;
+	const size_t length = nv->stop - nv->start;
+	assert(nv);
+	assert(defaults);
+
+	errno = 0;
+	if ((fd = open(nv->name, O_RDONLY)) < 0 || fstat(fd, &s) < 0) {
+		fprintf(stderr, "nvram load from '%s' failed: %s\n", nv->name, strerror(errno));
+		goto done;
+	}
+	if (nvram_trailer_read(fd, s.st_size, &h)) {
+		if (!nvram_header_compatible(nv, &h)) {
+			if ((r = nvram_migrate(nv, fd, &h)) > 0)
+				goto corrupt;
+			r = r < 0 ? -1 : 1;
+			goto done;
+		}
+		if (nvram_verify(nv, fd, &h, true))
+			goto corrupt;
+		nv->generation = h.generation;
+		nv->image_lsn  = h.lsn;
+		r = 0;
+		goto done;
+	}
+	if ((size_t)s.st_size == length) {
+		if (pread(fd, nv->start, length, 0) != (ssize_t)length)
+			goto corrupt;
+		r = 0;
+		goto done;
+	}
+	if ((size_t)s.st_size != nvram_file_size(nv)) {
+		fprintf(stderr, "nvram file '%s' is the wrong size (%lu bytes)\n", nv->name, (unsigned long)s.st_size);
+		goto done;
+	}
+corrupt:
+	fprintf(stderr, "nvram file '%s' is corrupt, using defaults\n", nv->name);
+	memcpy(nv->start, defaults, length);
+done:
+	if (fd >= 0)
+		close(fd);
+	return r;
+}
+
+/**< Load the newest valid slot of an A/B file into the section, falling back
+ * to the older slot if the newest is corrupt and to the defaults in 'defaults'
+ * if neither is valid. A slot with a different layout is migrated.
+ * @return 0 on success, 1 if no valid data was found or it was migrated */
+static int nvram_load_slots(nvram_t *nv, const char *defaults)
+{
+	int fd = -1, r = 1;
+	nvram_header_t h[2];
+	const size_t length = nv->stop - nv->start;
+	bool valid[2] = { false, false };
+	struct stat s;
+	assert(nv);
+	assert(defaults);
+
+	errno = 0;
+	if ((fd = open(nv->name, O_RDONLY)) < 0 || fstat(fd, &s) < 0) {
+		fprintf(stderr, "nvram slot load from '%s' failed: %s\n", nv->name, strerror(errno));
+		goto done;
+	}
+	for (unsigned i = 0; i < 2; i++)
+		valid[i] = pread(fd, &h[i], sizeof h[i], i * NVRAM_PAGE) == sizeof h[i] && nvram_header_valid(&h[i]);
+	const unsigned newest = valid[1] && (!valid[0] || h[1].generation > h[0].generation);
+	const unsigned order[2] = { newest, !newest };
+	for (unsigned n = 0; n < 2; n++) {
+		const unsigned i = order[n];
+		if (!valid[i])
+			continue;
+		if (!nvram_header_compatible(nv, &h[i])) {
+			const int m = nvram_migrate(nv, fd, &h[i]);
+			if (m > 0) {
+				fprintf(stderr, "nvram slot %u of '%s' is corrupt\n", i, nv->name);
+				continue;
+			}
+			r = m < 0 ? -1 : 1;
+			break;
+		}
+		if (nvram_verify(nv, fd, &h[i], true)) {
+			fprintf(stderr, "nvram slot %u of '%s' is corrupt\n", i, nv->name);
+			memcpy(nv->start, defaults, length);
+			continue;
+		}
+		nv->slot = i;
+		nv->generation = h[i].generation;
+		nv->image_lsn  = h[i].lsn;
+		r = 0;
+		break;
+	}
+done:
+	if (fd >= 0)
+		close(fd);
+	return r;
+}
+
+/**< Map the whole pages of the section onto the file 'nv->name', the file is
+ * created from the current (default) values if it is the wrong size. A file
+ * with slots, or with a different layout, is loaded (or migrated) and then
+ * replaced with a plain one. Any partial page at the end of the section is
+ * shared with other data and cannot be mapped, it is read in (and later
+ * written out) instead.
+ *
+ * Writes to a mapped section reach the file as they are made, but the
+ * trailer is only rewritten by 'nvram_sync', so if the program was killed
+ * before it could save the data is newer than the checksums in the trailer.
+ * The file is marked as open (NVRAM_OPEN_MAGIC) before the section is used,
+ * and only marked as closed by the final 'nvram_sync'. Data that does not
+ * match the trailer of an open file is kept and checksummed again, whereas in
+ * a closed file (or one with no valid trailer) it is corrupt and replaced by
+ * the defaults.
+ * @return 0< fatal error, 0 = okay, 1 = warning (defaults used, or unsaved data kept) */
+static int nvram_map(nvram_t *nv, const char *defaults)
+{
+	int r = 0;
+	bool create = false;
+	struct stat s;
+	nvram_header_t h;
+	const size_t length = nv->stop - nv->start;
+	const size_t whole  = length & ~((size_t)NVRAM_PAGE - 1);
+	assert(nv);
+	assert(nv->fd < 0);
+
+	if (NVRAM_PAGE % sysconf(_SC_PAGESIZE) || (uintptr_t)nv->start % NVRAM_PAGE) {
+		fprintf(stderr, "nvram section at %p not aligned for mapping\n", (void*)nv->start);
+		return -1;
+	}
+
+	errno = 0;
+	if ((nv->fd = open(nv->name, O_RDWR | O_CREAT, 0644)) < 0 || fstat(nv->fd, &s) < 0) {
+		fprintf(stderr, "nvram map of '%s' failed: %s\n", nv->name, strerror(errno));
+		goto fail;
+	}
+
+	if (pread(nv->fd, &h, sizeof h, 0) == sizeof h && h.magic == NVRAM_MAGIC) {
+		if ((r = nvram_load_slots(nv, defaults)) < 0) /* copy its contents into a new plain file */
+			goto fail;
+		create = true;
+	} else if (nvram_trailer_read(nv->fd, s.st_size, &h) && (!nvram_header_compatible(nv, &h) || h.codec)) { /* migrating also decompresses */
+		if ((r = nvram_migrate(nv, nv->fd, &h)) < 0)
+			goto fail;
+		if (r > 0)
+			fprintf(stderr, "nvram file '%s' is corrupt, using defaults\n", nv->name);
+		r = 1;
+		create = true;
+	} else if ((size_t)s.st_size != length && (size_t)s.st_size != nvram_file_size(nv)) {
+		if (s.st_size) /* an empty file was just created, there is nothing to warn about */
+			fprintf(stderr, "nvram file '%s' is the wrong size (%lu bytes), using defaults\n",
+					nv->name, (unsigned long)s.st_size);
+		r = 1;
+		create = true;
+	} else if (pread(nv->fd, nv->start + whole, length - whole, whole) != (ssize_t)(length - whole)) {
+		fprintf(stderr, "nvram read of '%s' failed: %s\n", nv->name, strerror(errno));
+		goto fail;
+	}
+
+	if (create) {
+		nv->generation = 0;
+		nv->rehash = true;
+		if (write_all(nv->fd, nv->start, length, 0) < 0 || ftruncate(nv->fd, nvram_file_size(nv)) < 0) {
+			fprintf(stderr, "nvram initializing '%s' failed: %s\n", nv->name, strerror(errno));
+			goto fail;
+		}
+	}
+
+	if (whole && mmap(nv->start, whole, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, nv->fd, 0) == MAP_FAILED) {
+		fprintf(stderr, "nvram mmap of '%s' failed: %s\n", nv->name, strerror(errno));
+		goto fail;
+	}
+	nv->mapped = whole;
+
+	if (!create && (size_t)s.st_size > length) {
+		const bool trailer = nvram_trailer_read(nv->fd, s.st_size, &h);
+		if (trailer) {
+			nv->generation = h.generation;
+			nv->image_lsn  = h.lsn;
+		}
+		if (trailer && nvram_verify(nv, nv->fd, &h, false) == 0) {
+			/* the checksums were read from the file and match */
+		} else if (trailer && h.magic == NVRAM_OPEN_MAGIC) {
+			fprintf(stderr, "nvram file '%s' was still open when its program stopped, keeping its data\n", nv->name);
+			r = 1;
+		} else {
+			fprintf(stderr, "nvram file '%s' is corrupt, using defaults\n", nv->name);
+			memcpy(nv->start, defaults, length);
+			nv->image_lsn = 0;
+			r = 1;
+		}
+	}
+
+	nv->open = true; /* before anything can be written to the mapping */
+	if (nv->rehash)
+		nvram_hash(nv, nv->start);
+	errno = 0;
+	if (nvram_trailer(nv, nv->fd) < 0 || (nv->durability != NVRAM_DURABLE_NONE && fdatasync(nv->fd) < 0)) {
+		fprintf(stderr, "nvram trailer of '%s' could not be written: %s\n", nv->name, strerror(errno));
+		goto fail;
+	}
+	return r;
+fail:
+	if (nv->fd >= 0)
+		close(nv->fd);
+	nv->fd = -1;
+	return -1;
+}
+
+/**< Flush a mapped section, the mapping is synchronized and the unmapped tail
+ * written out, followed by a new trailer. 'nv->lock' is only held whilst the
+ * section is checksummed and the tail copied, so that the trailer describes
+ * one consistent state of the variables and the journal records included in
+ * it, the section is synchronized after the lock is released so updates never
+ * wait for the disk. Updates made in the meantime may reach the file before
+ * the trailer does, which 'nvram_map' accepts as the file is still open.
+ * @param close no more updates will be made, the lock is held throughout and
+ * the file is marked as closed, so its checksums must match from then on */
+static int nvram_sync(nvram_t *nv, bool close)
+{
+	int r = -1;
+	char tail[NVRAM_PAGE];
+	const size_t length = nv->stop - nv->start;
+	assert(nv);
+	assert(nv->fd >= 0);
+	assert(length - nv->mapped <= sizeof tail);
+	const bool sync = nv->durability != NVRAM_DURABLE_NONE;
+	pthread_mutex_lock(&nv->lock);
+	nv->image_lsn = nv->lsn;
+	nv->rehash = true;
+	nvram_hash(nv, nv->start);
+	memcpy(tail, nv->start + nv->mapped, length - nv->mapped);
+	if (!close)
+		pthread_mutex_unlock(&nv->lock);
+	errno = 0;
+	if (nv->mapped && msync(nv->start, nv->mapped, sync ? MS_SYNC : MS_ASYNC) < 0)
+		goto done;
+	if (write_all(nv->fd, tail, length - nv->mapped, nv->mapped) < 0)
+		goto done;
+	if (sync && fdatasync(nv->fd) < 0)
+		goto done;
+	nv->open = !close; /* only once the data it describes is on disk */
+	if (nvram_trailer(nv, nv->fd) < 0)
+		goto done;
+	if (sync && fdatasync(nv->fd) < 0)
+		goto done;
+	r = 0;
+done:
+	if (close)
+		pthread_mutex_unlock(&nv->lock);
+	return r;
+}
+
+/**< start tracking writes to the whole pages of the section, the pages are
+ * write protected and a fault handler marks them dirty on first write. Data
+ * must not be read into the section with system calls (such as 'read')
+ * whilst it is protected as they fail with EFAULT instead of faulting.
+ * @param all_dirty mark all pages dirty, for when the file holds no valid copy */
+static int nvram_track(nvram_t *nv, bool all_dirty)
+{
+	assert(nv);
+	assert(!nv->dirty);
+	if ((uintptr_t)nv->start % NVRAM_PAGE || NVRAM_PAGE % sysconf(_SC_PAGESIZE)) {
+		fprintf(stderr, "nvram section at %p not aligned for tracking\n", (void*)nv->start);
+		return -1;
+	}
+	if (!(nv->changed = calloc(nv->pages + 1, 1)) || !(nv->dirty = calloc(nv->pages + 1, 1))) {
+		free(nv->changed);
+		nv->changed = NULL;
+		fputs("nvram dirty page table allocation failed\n", stderr);
+		return -1;
+	}
+	memset((void*)nv->dirty, all_dirty, nv->pages);
+	if (nv->ab) { /* contents of the older slot are unknown until the first save */
+		if (!(nv->prev = malloc(nv->pages + 1))) {
+			fputs("nvram previous page table allocation failed\n", stderr);
+			goto fail;
+		}
+		memset(nv->prev, 1, nv->pages);
+	}
+
+	if (nvram_catch_faults() < 0)
+		goto fail;
+	for (size_t i = 0; i < nv->pages; i++) /* unverified pages stay inaccessible */
+		if (!nv->dirty[i] && !(nv->unverified && nv->unverified[i]) && mprotect(nv->start + (i * NVRAM_PAGE), NVRAM_PAGE, PROT_READ) < 0)
+			goto fail;
+	return 0;
+fail:
+	fprintf(stderr, "nvram dirty page tracking failed: %s\n", strerror(errno));
+	mprotect(nv->start, nv->pages * NVRAM_PAGE, PROT_READ | PROT_WRITE);
+	free((void*)nv->dirty);
+	free(nv->changed);
+	free(nv->prev);
+	nv->dirty = NULL;
+	nv->changed = NULL;
+	nv->prev = NULL;
+	return -1;
+}
+
+/**< move the dirty page marks into 'nv->changed' and protect those pages
+ * again, copying each of them into 'copy' if it is not NULL. A page is marked
+ * clean before it is protected and copied, so a concurrent write to it either
+ * makes it into the copy or marks the page dirty again.
+ * @return number of pages collected */
+static size_t nvram_collect(nvram_t *nv, char *copy)
+{
+	size_t n = 0;
+	assert(nv);
+	assert(nv->dirty);
+	for (size_t i = 0; i < nv->pages; i++) {
+		char *page = nv->start + (i * NVRAM_PAGE);
+		nv->changed[i] = 0;
+		if (!nv->dirty[i])
+			continue;
+		nv->dirty[i] = 0;
+		nv->changed[i] = 1;
+		n++;
+		if (mprotect(page, NVRAM_PAGE, PROT_READ) < 0)
+			nv->dirty[i] = 1; /* still writable, so save it every time */
+		if (copy)
+			memcpy(copy + (i * NVRAM_PAGE), page, NVRAM_PAGE);
+		if (nv->snapshot && copy != nv->snapshot) /* keep the checkpointer's copy up to date */
+			memcpy(nv->snapshot + (i * NVRAM_PAGE), page, NVRAM_PAGE);
+	}
+	return n;
+}
+
+/**< mark the collected pages as dirty again after a failed save */
+static void nvram_redirty(nvram_t *nv)
+{
+	assert(nv);
+	for (size_t i = 0; nv->dirty && i < nv->pages; i++)
+		if (nv->changed[i])
+			nv->dirty[i] = 1;
+}
+
+/**< write the collected pages of 'image' (the section or a copy of it) into
+ * 'nv->name' in place, runs of pages are coalesced into a single write and the
+ * partial page at the end of the section and the trailer are always written.
+ * @return 0 on success, 1 if the file is unsuitable for an incremental update,
+ * 0< on failure */
+static int nvram_write_pages(nvram_t *nv, const char *image)
+{
+	int fd = -1, r = -1;
+	struct stat s;
+	const size_t length = nv->stop - nv->start;
+	const size_t whole = nv->pages * NVRAM_PAGE;
+	assert(nv);
+	assert(image);
+
+	errno = 0;
+	if ((fd = open(nv->name, O_WRONLY)) < 0 || fstat(fd, &s) < 0 || (size_t)s.st_size != nvram_file_size(nv)) {
+		r = 1;
+		goto done;
+	}
+	for (size_t i = 0, j = 0; i < nv->pages; i = j) {
+		for (j = i + 1; nv->changed[i] && j < nv->pages && nv->changed[j]; j++)
+			;
+		if (!nv->changed[i])
+			continue;
+		if (write_all(fd, image + (i * NVRAM_PAGE), (j - i) * NVRAM_PAGE, i * NVRAM_PAGE) < 0)
+			goto done;
+	}
+	if (write_all(fd, image + whole, length - whole, whole) < 0)
+		goto done;
+	if (nvram_trailer(nv, fd) < 0)
+		goto done;
+	r = 0;
+done:
+	if (fd >= 0)
+		close(fd);
+	return r;
+}
+
+/**< record that the image in 'slot' is now the newest, 'changed' are the
+ * pages that differ from the image in the other slot (which becomes the
+ * older one), unless the file was freshly created and the other slot is
+ * empty */
+static void nvram_slot_advance(nvram_t *nv, unsigned slot)
+{
+	if (nv->prev && nv->generation)
+		memcpy(nv->prev, nv->changed, nv->pages);
+	else if (nv->prev)
+		memset(nv->prev, 1, nv->pages);
+	nv->slot = slot;
+	nv->generation++;
+}
+
+/**< Write 'image' into the older slot of an A/B file, the header is written
+ * (and synced) only once the image is on disk so a crash at any point leaves
+ * the newest slot intact. When the section is tracked only the pages
+ * that changed in this save or the previous one are written, as the older
+ * slot holds the image from two saves ago. The first save to a file that
+ * does not have valid slots creates a fresh file atomically instead. */
+static int nvram_write_slot(nvram_t *nv, const char *image)
+{
+	int fd = -1, r = -1;
+	nvram_header_t h;
+	const size_t length = nv->stop - nv->start;
+	const size_t whole = nv->pages * NVRAM_PAGE;
+	const bool sync = nv->durability != NVRAM_DURABLE_NONE;
+	const unsigned slot = nv->generation ? !nv->slot : 0;
+	const off_t offset = nvram_slot_offset(nv, slot);
+	assert(nv);
+	assert(image);
+
+	nvram_header(nv, &h, offset);
+	if (!nv->generation) {
+		char *headers = NULL; /* page aligned for O_DIRECT, and not shared with other sections saving */
+		if ((errno = posix_memalign((void**)&headers, NVRAM_PAGE, 2 * NVRAM_PAGE))) {
+			fprintf(stderr, "nvram slot headers allocation failed: %s\n", strerror(errno));
+			return -1;
+		}
+		memset(headers, 0, 2 * NVRAM_PAGE);
+		memcpy(headers, &h, sizeof h);
+		const struct iovec parts[] = {
+			{ .iov_base = headers,       .iov_len = 2 * NVRAM_PAGE },
+			{ .iov_base = (char*)image,  .iov_len = length },
+			{ .iov_base = nv->crcs,      .iov_len = nvram_table_size(nv) },
+			{ .iov_base = nv->fields,    .iov_len = nvram_fields_size(nv) },
+		};
+		r = commit(nv->name, parts, 4, nv->durability, nv->direct, nv->threads);
+		free(headers);
+		if (r < 0)
+			return -1;
+		nvram_slot_advance(nv, slot);
+		return 0;
+	}
+
+	errno = 0;
+	if ((fd = open(nv->name, O_WRONLY)) < 0)
+		goto done;
+	if (nv->prev) {
+		for (size_t i = 0, j = 0; i < nv->pages; i = j) {
+			for (j = i + 1; (nv->changed[i] || nv->prev[i]) && j < nv->pages && (nv->changed[j] || nv->prev[j]); j++)
+				;
+			if (!nv->changed[i] && !nv->prev[i])
+				continue;
+			if (write_all(fd, image + (i * NVRAM_PAGE), (j - i) * NVRAM_PAGE, offset + (i * NVRAM_PAGE)) < 0)
+				goto done;
+		}
+		if (write_all(fd, image + whole, length - whole, offset + whole) < 0)
+			goto done;
+	} else {
+		const nvram_work_t job = { .run = parallel_write, .image = (char*)image, .length = length, .fd = fd, .direct = -1, .offset = offset };
+		if (parallel(&job, nv->chunks, nv->threads) < 0)
+			goto done;
+	}
+	if (write_all(fd, (char*)nv->crcs, nvram_table_size(nv), h.table) < 0)
+		goto done;
+	if (write_all(fd, (char*)nv->fields, nvram_fields_size(nv), h.fields) < 0)
+		goto done;
+	if (sync && fdatasync(fd) < 0)
+		goto done;
+	if (write_all(fd, (char*)&h, sizeof h, slot * NVRAM_PAGE) < 0)
+		goto done;
+	if (sync && fdatasync(fd) < 0)
+		goto done;
+	nvram_slot_advance(nv, slot);
+	r = 0;
+done:
+	if (r < 0)
+		fprintf(stderr, "nvram slot %u write to '%s' failed: %s\n", slot, nv->name, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return r;
+}
+
+/**< load a section from a file with or without slots, a file in the other
+ * format to that being saved in is replaced on the next save
+ * @return 0 on success, 1 if no valid data was found */
+static int nvram_load(nvram_t *nv, const char *defaults)
+{
+	int fd = -1, r = 0;
+	uint64_t magic = 0;
+	assert(nv);
+	if ((fd = open(nv->name, O_RDONLY)) >= 0) {
+		if (pread(fd, &magic, sizeof magic, 0) != sizeof magic)
+			magic = 0;
+		close(fd);
+	}
+	r = magic == NVRAM_MAGIC ? nvram_load_slots(nv, defaults) : nvram_load_image(nv, defaults);
+	if ((magic == NVRAM_MAGIC) != nv->ab)
+		nv->generation = 0;
+	return r;
+}
+
+/**< @return index of the first of words 'i' to 'words' of 'a' that differs
+ * from 'b', or 'words' if none do. Pages that are tracked and have not
+ * changed since the last save are skipped if 'skip' is set, and the rest
+ * are compared a cache line at a time. */
+static size_t nvram_delta_same(const nvram_t *nv, const uint64_t *a, const uint64_t *b, size_t i, size_t words, bool skip)
+{
+	const size_t per = NVRAM_PAGE / sizeof (uint64_t);
+	while (i < words) {
+		const size_t page = i / per, end = (page + 1) * per < words ? (page + 1) * per : words;
+		if (skip && page < nv->pages && !nv->changed[page]) {
+			i = end;
+			continue;
+		}
+		for (; i + 8 <= end; i += 8) {
+			uint64_t x = 0;
+			for (size_t k = 0; k < 8; k++)
+				x |= a[i + k] ^ b[i + k];
+			if (x)
+				break;
+		}
+		for (; i < end; i++)
+			if (a[i] != b[i])
+				return i;
+	}
+	return words;
+}
+
+/**< make room for 'words' more words in 'nv->delta' */
+static int nvram_delta_reserve(nvram_t *nv, size_t words)
+{
+	if (nv->delta_capacity - nv->delta_used >= words)
+		return 0;
+	const size_t capacity = (nv->delta_capacity + words) * 2;
+	uint64_t *delta = realloc(nv->delta, capacity * sizeof *delta);
+	if (!delta) {
+		fputs("nvram history allocation failed\n", stderr);
+		return -1;
+	}
+	nv->delta = delta;
+	nv->delta_capacity = capacity;
+	return 0;
+}
+
+/**< Encode the differences between 'image' and 'nv->base' into 'nv->delta',
+ * in the format described for 'nvram_delta_t'. The words of the two that
+ * are the same are skipped quickly, so the time taken depends mostly on how
+ * much has changed, and for a tracked section unchanged pages are not read.
+ * @return 0 on success, 0< on failure */
+static int nvram_delta_encode(nvram_t *nv, const char *image)
+{
+	const size_t length = nv->stop - nv->start, words = length / sizeof (uint64_t);
+	const uint64_t *a = (const uint64_t*)image, *b = (const uint64_t*)nv->base;
+	const bool skip = nv->dirty && !nv->rehash;
+	uint64_t tail[2] = { 0, 0 };
+	size_t i = 0, run = 0;
+	assert(nv);
+	assert(nv->base);
+	nv->delta_used = 0;
+	while ((i = nvram_delta_same(nv, a, b, i, words, skip)) < words) {
+		size_t j = i + 1;
+		while (j < words && a[j] != b[j])
+			j++;
+		if (nvram_delta_reserve(nv, 2 + j - i) < 0)
+			return -1;
+		uint64_t *d = nv->delta + nv->delta_used;
+		d[0] = i - run;
+		d[1] = j - i;
+		for (size_t k = i; k < j; k++)
+			d[2 + k - i] = a[k] ^ b[k];
+		nv->delta_used += 2 + j - i;
+		run = i = j;
+	}
+	memcpy(&tail[0], image + (words * sizeof (uint64_t)), length % sizeof (uint64_t));
+	memcpy(&tail[1], nv->base + (words * sizeof (uint64_t)), length % sizeof (uint64_t));
+	if (tail[0] != tail[1]) {
+		if (nvram_delta_reserve(nv, 3) < 0)
+			return -1;
+		nv->delta[nv->delta_used++] = words - run;
+		nv->delta[nv->delta_used++] = 1;
+		nv->delta[nv->delta_used++] = tail[0] ^ tail[1];
+	}
+	return 0;
+}
+
+/**< exclusive or the 'size' words of differences in 'delta' into the
+ * 'length' bytes of 'image', turning one image into the other
+ * @return 0 on success, 0< if 'delta' is not valid for 'image' */
+static int nvram_delta_apply(char *image, size_t length, const uint64_t *delta, size_t size)
+{
+	size_t at = 0;
+	for (size_t i = 0; i < size;) {
+		if (size - i < 2 || delta[i] > length || delta[i + 1] > size - i - 2)
+			return -1;
+		at += delta[i] * sizeof (uint64_t);
+		const size_t n = delta[i + 1];
+		if (at > length || n * sizeof (uint64_t) > length - at + sizeof (uint64_t) - 1)
+			return -1;
+		for (size_t k = 0; k < n; k++, at += sizeof (uint64_t)) {
+			uint64_t w = 0;
+			const size_t bytes = length - at < sizeof w ? length - at : sizeof w;
+			memcpy(&w, image + at, bytes);
+			w ^= delta[i + 2 + k];
+			memcpy(image + at, &w, bytes);
+		}
+		i += 2 + n;
+	}
+	return 0;
+}
+
+/**< Check the record at 'offset' in the 'size' bytes of history in 'log'
+ * @return size of the record and its runs, 0 if it is invalid or torn */
+static size_t nvram_history_next(const char *log, size_t size, size_t offset, nvram_delta_t *h)
+{
+	if (size - offset < sizeof *h)
+		return 0;
+	memcpy(h, log + offset, sizeof *h);
+	if (h->magic != NVRAM_DELTA_MAGIC || nvram_crc32c(0, h, offsetof(nvram_delta_t, header_crc)) != h->header_crc)
+		return 0;
+	if (h->size % sizeof (uint64_t) || h->size > size - offset - sizeof *h)
+		return 0;
+	if (nvram_crc32c(0, log + offset + sizeof *h, h->size) != h->crc)
+		return 0;
+	return sizeof *h + h->size;
+}
+
+/**< read the whole history, the caller frees it
+ * @return the history, NULL if there is none or on failure (with '*size' of 0 if it is empty or missing) */
+static char *nvram_history_read(nvram_t *nv, size_t *size)
+{
+	struct stat s;
+	char *log = NULL;
+	int fd = -1;
+	*size = 0;
+	if ((fd = open(nv->history_name, O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			fprintf(stderr, "nvram history open of '%s' failed: %s\n", nv->history_name, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &s) < 0 || !s.st_size)
+		goto done;
+	if (!(log = malloc(s.st_size))) {
+		fputs("nvram history allocation failed\n", stderr);
+		goto done;
+	}
+	if (pread(fd, log, s.st_size, 0) != s.st_size) {
+		fprintf(stderr, "nvram history read of '%s' failed: %s\n", nv->history_name, strerror(errno));
+		free(log);
+		log = NULL;
+		goto done;
+	}
+	*size = s.st_size;
+done:
+	close(fd);
+	return log;
+}
+
+/**< Keep a copy of the image just loaded, 'nv->base', to find the changes
+ * made by the next save, find the end of the history (anything after the
+ * last valid record is overwritten) and roll the section back by
+ * 'nv->rollback' images if asked to. The history is followed back from the
+ * newest record for the generation loaded, each record must lead to the
+ * generation of an older one, so records of saves that were never completed
+ * (a record is written before its image) are passed over.
+ * @return 0 on success, 1 if the section was rolled back, 0< on failure */
+static int nvram_history_open(nvram_t *nv)
+{
+	const size_t length = nv->stop - nv->start;
+	size_t size = 0, offset = 0, n = 0, count = 0;
+	nvram_delta_t h;
+	char *image = NULL;
+	int r = 0;
+	assert(nv);
+	if (!(nv->base = malloc(length + 1))) {
+		fputs("nvram history allocation failed\n", stderr);
+		return -1;
+	}
+	memcpy(nv->base, nv->start, length);
+	char *log = nvram_history_read(nv, &size);
+	if (!log && size)
+		return -1;
+	size_t *records = malloc((size / sizeof h + 1) * sizeof *records);
+	if (!records) {
+		fputs("nvram history allocation failed\n", stderr);
+		free(log);
+		return -1;
+	}
+	for (; (n = nvram_history_next(log, size, offset, &h)); offset += n)
+		records[count++] = offset;
+	nv->history_size = offset;
+	nv->deltas = count;
+
+	uint64_t generation = nv->generation;
+	size_t back = 0, *path = nv->rollback ? malloc(nv->rollback * sizeof *path) : NULL;
+	if (nv->rollback && !path) {
+		fputs("nvram history allocation failed\n", stderr);
+		r = -1;
+		goto done;
+	}
+	for (size_t i = count; back < nv->rollback && i--;) {
+		memcpy(&h, log + records[i], sizeof h);
+		if (h.to != generation || h.length != length || h.layout != nv->layout)
+			continue;
+		path[back++] = records[i];
+		generation = h.from;
+	}
+	if (back < nv->rollback) {
+		fprintf(stderr, "nvram history '%s' goes back %u images from generation %"PRIu64", not %u\n",
+				nv->history_name, (unsigned)back, nv->generation, nv->rollback);
+		r = -1;
+		goto done;
+	}
+	if (back && !(image = malloc(length + 1))) {
+		fputs("nvram history allocation failed\n", stderr);
+		r = -1;
+		goto done;
+	}
+	if (back)
+		memcpy(image, nv->base, length);
+	for (size_t i = 0; i < back; i++) { /* newest first, onto a copy so a bad record leaves the section alone */
+		memcpy(&h, log + path[i], sizeof h);
+		if (nvram_delta_apply(image, length, (const uint64_t*)(log + path[i] + sizeof h), h.size / sizeof (uint64_t)) < 0) {
+			fprintf(stderr, "nvram history '%s' record for generation %"PRIu64" is invalid\n", nv->history_name, h.to);
+			r = -1;
+			goto done;
+		}
+	}
+	if (back) {
+		memcpy(nv->start, image, length);
+		fprintf(stderr, "nvram '%s' rolled back from generation %"PRIu64" to %"PRIu64"\n", nv->name, nv->generation, generation);
+		nv->rehash = true;
+		r = 1;
+	}
+done:
+	free(image);
+	free(path);
+	free(records);
+	free(log);
+	return r;
+}
+
+/**< forget the image last saved, which is not known after a save that the
+ * history was not told about, until the next save */
+static void nvram_history_forget(nvram_t *nv)
+{
+	assert(nv);
+	free(nv->base);
+	nv->base = NULL;
+}
+
+/**< Record the differences between 'image', which is about to be saved, and
+ * the image last saved in the history, before 'image' is written. Once the
+ * history holds twice as many records as are kept it is replaced by one
+ * holding only the newest, so each save only appends a record. Nothing is
+ * recorded if the image last saved is not known, as after a background save.
+ * @return 0 on success (or if there is no history), 0< on failure */
+static int nvram_history_record(nvram_t *nv, const char *image)
+{
+	const size_t length = nv->stop - nv->start;
+	int fd = -1, r = -1;
+	assert(nv);
+	nv->delta_used = 0;
+	if (!nv->keep || !nv->base)
+		return 0;
+	if (nvram_delta_encode(nv, image) < 0) { /* so the next save cannot be recorded either */
+		nv->delta_used = 0;
+		nvram_history_forget(nv);
+		return -1;
+	}
+	nvram_delta_t h = {
+		.magic  = NVRAM_DELTA_MAGIC,
+		.from   = nv->generation,
+		.to     = nv->generation + 1,
+		.length = length,
+		.size   = nv->delta_used * sizeof (uint64_t),
+		.layout = nv->layout,
+		.crc    = nvram_crc32c(0, nv->delta, nv->delta_used * sizeof (uint64_t)),
+	};
+	h.header_crc = nvram_crc32c(0, &h, offsetof(nvram_delta_t, header_crc));
+
+	if (nv->deltas >= 2 * nv->keep) {
+		size_t size = 0, offset = 0, n = 0, skip = nv->deltas - nv->keep + 1;
+		nvram_delta_t old;
+		char *log = nvram_history_read(nv, &size);
+		for (; skip && (n = nvram_history_next(log, size, offset, &old)); offset += n)
+			skip--;
+		if (log && !skip && nv->history_size <= (off_t)size) {
+			const struct iovec parts[] = {
+				{ .iov_base = log + offset,      .iov_len = nv->history_size - offset },
+				{ .iov_base = &h,                .iov_len = sizeof h },
+				{ .iov_base = nv->delta,         .iov_len = h.size },
+			};
+			if (commit(nv->history_name, parts, 3, nv->durability, false, 0) == 0) {
+				nv->history_size += sizeof h + h.size - offset;
+				nv->deltas = nv->keep;
+				r = 0;
+			}
+		}
+		free(log);
+		if (r < 0)
+			fprintf(stderr, "nvram history compaction of '%s' failed\n", nv->history_name);
+		return r;
+	}
+
+	errno = 0;
+	if ((fd = open(nv->history_name, O_WRONLY | O_CREAT, 0644)) < 0)
+		goto done;
+	if (write_all(fd, (char*)&h, sizeof h, nv->history_size) < 0)
+		goto done;
+	if (write_all(fd, (char*)nv->delta, h.size, nv->history_size + sizeof h) < 0)
+		goto done;
+	if (nv->durability != NVRAM_DURABLE_NONE && fdatasync(fd) < 0)
+		goto done;
+	nv->history_size += sizeof h + h.size;
+	nv->deltas++;
+	r = 0;
+done:
+	if (r < 0)
+		fprintf(stderr, "nvram history write to '%s' failed: %s\n", nv->history_name, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return r;
+}
+
+/**< the image recorded by 'nvram_history_record' has been saved (if 'saved'
+ * is true), or not, bring the copy of the image last saved up to date */
+static void nvram_history_saved(nvram_t *nv, const char *image, bool saved)
+{
+	const size_t length = nv->stop - nv->start;
+	assert(nv);
+	if (!nv->keep || !saved)
+		return;
+	if (nv->base && nvram_delta_apply(nv->base, length, nv->delta, nv->delta_used) == 0)
+		return;
+	if (nv->base || (nv->base = malloc(length + 1)))
+		memcpy(nv->base, image, length);
+}
+
+/**< write out 'image', a complete copy of the section with the pages changed
+ * since the last save in 'nv->changed' if the section is tracked. Only the
+ * changed pages are written when the file can be updated in place
+ * (NVRAM_DURABLE_NONE), otherwise the whole file is atomically replaced */
+static int nvram_write(nvram_t *nv, const char *image)
+{
+	int r = 1;
+	assert(nv);
+	assert(image);
+	nvram_history_record(nv, image); /* failing to record the save does not stop it */
+	if (nvram_pack(nv, image) < 0) {
+		nvram_redirty(nv);
+		return -1;
+	}
+	nvram_hash(nv, image);
+	if (nv->ab) {
+		if ((r = nvram_write_slot(nv, image)) < 0)
+			nvram_redirty(nv);
+		nvram_history_saved(nv, image, r == 0);
+		return r;
+	}
+	if (nv->dirty && nv->durability == NVRAM_DURABLE_NONE && !nv->compress) /* compressed chunks move */
+		r = nvram_write_pages(nv, image);
+	if (r > 0) {
+		nvram_header_t h;
+		nvram_header(nv, &h, 0);
+		const struct iovec parts[] = {
+			{ .iov_base = nv->compress ? (char*)nv->packed : (char*)image, .iov_len = h.table },
+			{ .iov_base = nv->crcs,     .iov_len = nvram_table_size(nv) },
+			{ .iov_base = nv->fields,   .iov_len = nvram_fields_size(nv) },
+			{ .iov_base = &h,           .iov_len = sizeof h },
+		};
+		if ((r = commit(nv->name, parts, 4, nv->durability, nv->direct && !nv->compress, nv->threads)) == 0)
+			nv->generation++;
+	}
+	if (r < 0)
+		nvram_redirty(nv);
+	nvram_history_saved(nv, image, r == 0);
+	return r;
+}
+
+/**< seconds elapsed since 'start' */
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/**< size of a journal record holding 'length' bytes, with its padding */
+static size_t nvram_record_size(size_t length)
+{
+	return (sizeof (nvram_record_t) + length + 7) & ~(size_t)7;
+}
+
+static uint32_t nvram_record_crc(const nvram_t *nv, const nvram_record_t *r, const void *bytes)
+{
+	return nvram_crc32c(nvram_crc32c(nv->layout, r, offsetof(nvram_record_t, crc)), bytes, r->length);
+}
+
+/**< Check the record at 'offset' in the 'size' bytes of journal in 'log'
+ * @return size of the record, 0 if it is invalid or torn */
+static size_t nvram_wal_next(const nvram_t *nv, const char *log, size_t size, size_t offset, nvram_record_t *r)
+{
+	const size_t length = nv->stop - nv->start;
+	if (size - offset < sizeof *r)
+		return 0;
+	memcpy(r, log + offset, sizeof *r);
+	if (r->length > length || r->offset > length - r->length || size - offset < nvram_record_size(r->length))
+		return 0;
+	if (nvram_record_crc(nv, r, log + offset + sizeof *r) != r->crc)
+		return 0;
+	return nvram_record_size(r->length);
+}
+
+/**< read the whole journal, the caller frees it
+ * @return the journal, NULL on failure (with '*size' of 0 if it is empty) */
+static char *nvram_wal_read(nvram_t *nv, int fd, size_t *size)
+{
+	struct stat s;
+	char *log = NULL;
+	*size = 0;
+	if (fstat(fd, &s) < 0 || !s.st_size)
+		return NULL;
+	if (!(log = malloc(s.st_size))) {
+		fputs("nvram journal allocation failed\n", stderr);
+		return NULL;
+	}
+	if (pread(fd, log, s.st_size, 0) != s.st_size) {
+		fprintf(stderr, "nvram journal read of '%s' failed: %s\n", nv->wal_name, strerror(errno));
+		free(log);
+		return NULL;
+	}
+	*size = s.st_size;
+	return log;
+}
+
+/**< Open the journal and apply the records in it that are newer than the
+ * image just loaded, stopping at the first invalid (torn) record which is
+ * truncated along with anything after it. A journal that does not follow on
+ * from the image, because the image was lost or migrated, is discarded.
+ * @return number of records applied, 0< on failure */
+static long nvram_wal_replay(nvram_t *nv)
+{
+	long applied = 0;
+	size_t size = 0, offset = 0, n = 0;
+	uint64_t last = nv->image_lsn;
+	nvram_record_t r;
+	assert(nv);
+	assert(nv->wal < 0);
+
+	errno = 0;
+	if ((nv->wal = open(nv->wal_name, O_RDWR | O_CREAT, 0644)) < 0) {
+		fprintf(stderr, "nvram journal open of '%s' failed: %s\n", nv->wal_name, strerror(errno));
+		return -1;
+	}
+	char *log = nvram_wal_read(nv, nv->wal, &size);
+	if (!log && size)
+		return -1;
+	for (; (n = nvram_wal_next(nv, log, size, offset, &r)); offset += n) {
+		if (offset == 0 && r.lsn > nv->image_lsn + 1) {
+			fprintf(stderr, "nvram journal '%s' does not follow on from the image, discarding it\n", nv->wal_name);
+			break;
+		}
+		if (offset && r.lsn != last + 1)
+			break;
+		last = r.lsn;
+		if (r.lsn <= nv->image_lsn)
+			continue;
+		memcpy(nv->start + r.offset, log + offset + sizeof r, r.length);
+		applied++;
+	}
+	free(log);
+	if (offset != size && ftruncate(nv->wal, offset) < 0) {
+		fprintf(stderr, "nvram journal truncation of '%s' failed: %s\n", nv->wal_name, strerror(errno));
+		return -1;
+	}
+	nv->wal_size = offset;
+	nv->lsn = nv->durable = offset ? last : nv->image_lsn;
+	return applied;
+}
+
+/**< Append a record of the 'length' bytes at 'address', which have just been
+ * updated, to the journal. The record is only buffered, 'nvram_wal_commit'
+ * writes it out. This must be called with 'nv->lock' held so that saves see
+ * both the update and the record, or neither.
+ * @return log sequence number of the record, 0 on failure */
+static uint64_t nvram_wal_append(nvram_t *nv, const volatile void *address, size_t length)
+{
+	const size_t size = nvram_record_size(length);
+	assert(nv);
+	assert(nv->journal);
+	assert((const volatile char*)address >= nv->start && (const volatile char*)address + length <= nv->stop);
+	if (nv->used + size > nv->capacity) {
+		const size_t capacity = (nv->used + size) * 2;
+		char *pending = realloc(nv->pending, capacity);
+		if (!pending) {
+			fputs("nvram journal allocation failed\n", stderr);
+			return 0;
+		}
+		nv->pending  = pending;
+		nv->capacity = capacity;
+	}
+	nvram_record_t r = {
+		.lsn    = nv->lsn + 1,
+		.offset = (const volatile char*)address - nv->start,
+		.length = length,
+	};
+	char *record = nv->pending + nv->used;
+	memcpy(record + sizeof r, (const void*)address, length);
+	memset(record + sizeof r + length, 0, size - sizeof r - length);
+	r.crc = nvram_record_crc(nv, &r, record + sizeof r);
+	memcpy(record, &r, sizeof r);
+	nv->used += size;
+	return ++nv->lsn;
+}
+
+/**< Write out every buffered record as a single batch, 'nv->wal_lock' is
+ * held on entry and exit but not whilst writing. A batch that cannot be
+ * written is put back in front of the records buffered since, so the next
+ * batch retries it and there is never a gap in the journal. */
+static int nvram_wal_flush(nvram_t *nv)
+{
+	int r = 0;
+	assert(nv);
+	assert(nv->flushing);
+	pthread_mutex_lock(&nv->lock);
+	char *batch = nv->pending;
+	const size_t used = nv->used;
+	const uint64_t last = nv->lsn;
+	nv->pending = NULL;
+	nv->used = nv->capacity = 0;
+	pthread_mutex_unlock(&nv->lock);
+	const off_t offset = nv->wal_size;
+	pthread_mutex_unlock(&nv->wal_lock);
+
+	errno = 0;
+	if (write_all(nv->wal, batch, used, offset) < 0 || (nv->durability != NVRAM_DURABLE_NONE && fdatasync(nv->wal) < 0)) {
+		fprintf(stderr, "nvram journal write to '%s' failed: %s\n", nv->wal_name, strerror(errno));
+		if (ftruncate(nv->wal, offset) < 0) { /* a torn record is ignored on replay anyway */ }
+		pthread_mutex_lock(&nv->lock);
+		char *pending = realloc(batch, used + nv->used + 1);
+		if (pending) {
+			memcpy(pending + used, nv->pending, nv->used);
+			free(nv->pending);
+			nv->pending  = pending;
+			nv->used    += used;
+			nv->capacity = nv->used + 1;
+			batch = NULL;
+		}
+		pthread_mutex_unlock(&nv->lock);
+		r = -1;
+	}
+	free(batch);
+
+	pthread_mutex_lock(&nv->wal_lock);
+	nv->flushes++;
+	if (r < 0) {
+		nv->failed = last;
+		nv->wal_stats.failures++;
+	} else {
+		const unsigned long records = last - nv->durable;
+		nv->wal_stats.batches++;
+		nv->wal_stats.records += records;
+		if (records > nv->wal_stats.largest)
+			nv->wal_stats.largest = records;
+		nv->wal_size += used;
+		nv->durable = last;
+	}
+	nv->flushing = false;
+	pthread_cond_broadcast(&nv->wal_done);
+	return r;
+}
+
+/**< Make the records up to 'lsn' durable. Commits are grouped; the first
+ * caller to find no batch in progress becomes the leader, waits up to
+ * 'nv->window' microseconds for other threads to append more records, then
+ * writes (and syncs) everything buffered in one go. Callers arriving in the
+ * meantime wait for the leader instead of writing themselves, and a caller
+ * whose records were written by an earlier batch returns at once. Compaction
+ * is requested once the journal exceeds 'nv->wal_limit'.
+ * @return 0 on success, 0< if the batch holding 'lsn' could not be written */
+static int nvram_wal_commit(nvram_t *nv, uint64_t lsn)
+{
+	int r = 0;
+	struct timespec start;
+	assert(nv);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&nv->wal_lock);
+	if (nv->durable >= lsn)
+		goto done;
+	const unsigned long flushes = nv->flushes;
+	while (nv->durable < lsn && r == 0) {
+		if (nv->flushes != flushes && nv->failed >= lsn) {
+			r = -1; /* a batch holding the record failed, it is retried by the next one */
+		} else if (nv->flushing) {
+			pthread_cond_wait(&nv->wal_done, &nv->wal_lock);
+		} else {
+			nv->flushing = true;
+			if (nv->window) {
+				struct timespec deadline = start;
+				deadline.tv_nsec += (long)nv->window * 1000l;
+				deadline.tv_sec  += deadline.tv_nsec / 1000000000l;
+				deadline.tv_nsec %= 1000000000l;
+				while (pthread_cond_timedwait(&nv->wal_done, &nv->wal_lock, &deadline) != ETIMEDOUT)
+					;
+			}
+			r = nvram_wal_flush(nv);
+		}
+	}
+	const double latency = elapsed(&start);
+	nv->wal_stats.commits++;
+	nv->wal_stats.latency += latency;
+	if (latency > nv->wal_stats.worst)
+		nv->wal_stats.worst = latency;
+	if (nv->wal_size > (off_t)nv->wal_limit) {
+		pthread_mutex_lock(&nv->control);
+		nv->compact = true;
+		if (nv->running)
+			pthread_cond_signal(&nv->wake);
+		pthread_mutex_unlock(&nv->control);
+	}
+done:
+	pthread_mutex_unlock(&nv->wal_lock);
+	return r;
+}
+
+/**< Drop the records up to 'lsn', which are in an image that has been
+ * saved, from the journal. Newer records are copied into a new journal that
+ * atomically replaces the old one, if there are none it is just truncated. */
+static int nvram_wal_compact(nvram_t *nv, uint64_t lsn)
+{
+	int r = 0;
+	size_t size = 0, offset = 0, n = 0;
+	nvram_record_t record;
+	assert(nv);
+	if (nv->wal < 0)
+		return 0;
+	pthread_mutex_lock(&nv->wal_lock);
+	while (nv->flushing)
+		pthread_cond_wait(&nv->wal_done, &nv->wal_lock);
+	char *log = nvram_wal_read(nv, nv->wal, &size);
+	if (!log) {
+		r = -!!size;
+		goto done;
+	}
+	for (; (n = nvram_wal_next(nv, log, size, offset, &record)) && record.lsn <= lsn; offset += n)
+		;
+	errno = 0;
+	if (offset == size) {
+		if (ftruncate(nv->wal, 0) < 0)
+			r = -1;
+	} else if (offset) {
+		const struct iovec parts[] = { { .iov_base = log + offset, .iov_len = size - offset } };
+		if (commit(nv->wal_name, parts, 1, nv->durability, false, 0) < 0) {
+			r = -1;
+		} else {
+			close(nv->wal);
+			if ((nv->wal = open(nv->wal_name, O_RDWR)) < 0)
+				r = -1;
+		}
+	}
+	if (r == 0)
+		nv->wal_size = size - offset;
+	else
+		fprintf(stderr, "nvram journal compaction of '%s' failed: %s\n", nv->wal_name, strerror(errno));
+done:
+	free(log);
+	pthread_mutex_unlock(&nv->wal_lock);
+	return r;
+}
+
+/**< check on a background save started by 'nvram_bgsave', optionally waiting
+ * for it to finish, 'nv->save' must be held. The results are stored in
+ * 'nv->bgsave'.
+ * @return 0 if the save completed (or there was none), 1 if it is still in
+ * progress, 0< if it failed */
+static int nvram_bgsave_reap(nvram_t *nv, bool wait)
+{
+	int status = 0;
+	struct { int status; double write; } report = { 1, 0 };
+	assert(nv);
+	if (!nv->child)
+		return 0;
+	const pid_t r = waitpid(nv->child, &status, wait ? 0 : WNOHANG);
+	if (r == 0 || (r < 0 && errno == EINTR))
+		return 1;
+	if (read(nv->report, &report, sizeof report) != sizeof report || !WIFEXITED(status) || WEXITSTATUS(status))
+		report.status = 1;
+	close(nv->report);
+	nv->child = 0;
+	nv->bgsave.total  = elapsed(&nv->forked);
+	nv->bgsave.write  = report.write;
+	nv->bgsave.status = report.status;
+	if (report.status) {
+		nv->bgsave.failures++;
+		if (nv->dirty) /* the pages collected for the save may have been reused since */
+			memset((void*)nv->dirty, 1, nv->pages);
+		if (nv->ab) /* slot contents unknown, the next save recreates the file */
+			nv->generation = 0;
+		fprintf(stderr, "nvram background save of '%s' failed\n", nv->name);
+		return -1;
+	}
+	nv->bgsave.saves++;
+	return nvram_wal_compact(nv, nv->bgsave.lsn);
+}
+
+#define NVRAM_ASYNC_SYNC (UINT64_MAX) /**< user data for the sync of an asynchronous save */
+
+/**< Submit as many of the writes of the asynchronous save in progress as
+ * will fit, followed by a sync (which is drained, so it only starts once
+ * every write has finished) and collect any that have finished, waiting
+ * for at least one if 'wait' is true. Without io_uring everything is
+ * written and synced with plain blocking calls. */
+static void nvram_async_pump(nvram_t *nv, bool wait)
+{
+	nvram_async_t *a = &nv->async;
+	const bool sync = nv->durability != NVRAM_DURABLE_NONE;
+	assert(nv);
+	if (a->ring.fd < 0) {
+		for (; a->next < a->count && !a->failed; a->next++, a->done++)
+			a->failed = write_all(a->fd, a->io[a->next].buffer, a->io[a->next].length, a->io[a->next].offset) < 0;
+		a->done = a->next = a->count;
+		a->sync = a->synced = true;
+		if (sync && !a->failed && fdatasync(a->fd) < 0)
+			a->failed = true;
+		return;
+	}
+#ifdef NVRAM_URING
+	unsigned submit = 0;
+	nvram_uring_t *u = &a->ring;
+	for (; !a->failed && a->next < a->count && a->inflight < NVRAM_ASYNC_DEPTH; a->next++, a->inflight++, submit++) {
+		const nvram_io_t *io = &a->io[a->next];
+		if (!nvram_uring_push(u, IORING_OP_WRITE, 0, a->fd, io->buffer, io->length, io->offset, a->next))
+			break;
+	}
+	if (!a->failed && a->next == a->count && !a->sync) {
+		if (!sync || nvram_uring_push(u, IORING_OP_FSYNC, IOSQE_IO_DRAIN, a->fd, NULL, 0, 0, NVRAM_ASYNC_SYNC)) {
+			submit += sync;
+			a->inflight += sync;
+			a->sync = true;
+			a->synced = !sync;
+		}
+	}
+	if (nvram_uring_enter(u, submit, wait && a->inflight) < 0) {
+		fprintf(stderr, "nvram io_uring submission failed: %s\n", strerror(errno));
+		a->failed = true;
+		close(u->fd); /* every request submitted, by this or an earlier call, is abandoned with the ring */
+		u->fd = -1;
+		a->inflight = 0;
+		return;
+	}
+	uint64_t data = 0;
+	int result = 0;
+	while (nvram_uring_reap(u, &data, &result)) {
+		a->inflight--;
+		if (data == NVRAM_ASYNC_SYNC) {
+			a->synced = result == 0;
+			a->failed |= result != 0;
+			continue;
+		}
+		a->done++;
+		if (result < 0 || (size_t)result != a->io[data].length) { /* short writes are not retried */
+			errno = result < 0 ? -result : ENOSPC;
+			a->failed = true;
+		}
+	}
+#else
+	(void)wait;
+#endif
+}
+
+/**< Make progress on the asynchronous save in progress, as for
+ * 'nvram_async_poll', with 'nv->save' held. A finished save is renamed over
+ * the file and the journal records it includes are dropped.
+ * @return 1 if the save is still in progress, 0 if it has finished (or there
+ * was none), 0< if it failed */
+static int nvram_async_drain(nvram_t *nv, bool wait)
+{
+	nvram_async_t *a = &nv->async;
+	int r = 0;
+	assert(nv);
+	if (!a->busy)
+		return 0;
+	do
+		nvram_async_pump(nv, wait);
+	while (wait && (a->inflight || (!a->failed && (a->done < a->count || !a->synced))));
+	if (a->inflight || (!a->failed && (a->done < a->count || !a->synced)))
+		return 1;
+
+	r = commit_finish(nv->name, a->tmp, a->fd, nv->durability, true, a->failed);
+	a->tmp  = NULL;
+	a->fd   = -1;
+	a->busy = false;
+	a->total = elapsed(&a->started);
+	if (r < 0) {
+		a->failures++;
+		nv->rehash = true;
+		if (nv->dirty) /* the pages collected for the save may have been reused since */
+			memset((void*)nv->dirty, 1, nv->pages);
+	} else {
+		a->saves++;
+		nvram_history_saved(nv, a->image, true);
+		nv->generation = a->header.generation;
+		r = nvram_wal_compact(nv, a->lsn);
+	}
+	return r;
+}
+
+/**< save a section to disk directly from the section, any background or
+ * asynchronous save still in progress is finished first, as it would
+ * otherwise replace the file with an older image once this save is done.
+ * 'close' is set for the last save, after which no updates are made, a mapped
+ * file is then marked as closed (see 'nvram_sync'). */
+static int nvram_store(nvram_t *nv, bool close)
+{
+	int r = 0;
+	assert(nv);
+	pthread_mutex_lock(&nv->save);
+	nvram_bgsave_reap(nv, true); /* a failure marks every page dirty, which this save writes */
+	nvram_async_drain(nv, true);
+	if (nv->fd >= 0) {
+		r = nvram_sync(nv, close);
+	} else {
+		pthread_mutex_lock(&nv->lock);
+		nv->image_lsn = nv->lsn; /* later updates may also be saved, replaying them is harmless */
+		pthread_mutex_unlock(&nv->lock);
+		nvram_settle(nv);
+		if (nv->dirty)
+			nvram_collect(nv, NULL);
+		r = nvram_write(nv, nv->start);
+	}
+	if (r == 0)
+		r = nvram_wal_compact(nv, nv->image_lsn);
+	pthread_mutex_unlock(&nv->save);
+	return r;
+}
+
+/**< take a consistent copy of the section whilst holding 'nv->lock' and write
+ * it out without holding the lock, so that threads updating variables are
+ * only held up for as long as it takes to copy the modified pages.
+ * @return 0 on success or if nothing needed saving, 0< on failure */
+static int nvram_checkpoint(nvram_t *nv)
+{
+	int r = 0;
+	const size_t length = nv->stop - nv->start;
+	assert(nv);
+	assert(nv->snapshot);
+	pthread_mutex_lock(&nv->control);
+	const bool compact = nv->compact;
+	nv->compact = false;
+	pthread_mutex_unlock(&nv->control);
+	if (nv->dirty && !compact) {
+		const size_t whole = nv->pages * NVRAM_PAGE; /* the partial last page is not tracked, compare it */
+		size_t dirty = memcmp(nv->snapshot + whole, nv->start + whole, length - whole) != 0;
+		for (size_t i = 0; i < nv->pages; i++)
+			dirty += !!nv->dirty[i];
+		if (dirty < nv->threshold)
+			return 0;
+	}
+
+	pthread_mutex_lock(&nv->save);
+	if (nv->child || nv->async.busy) /* a background or asynchronous save is in progress */
+		goto done;
+	if (nv->fd >= 0) { /* there is no copy, updates only wait for the section to be checksummed */
+		r = nvram_sync(nv, false);
+		goto done;
+	}
+	pthread_mutex_lock(&nv->lock);
+	nv->image_lsn = nv->lsn;
+	if (nv->dirty) {
+		nvram_collect(nv, nv->snapshot);
+		memcpy(nv->snapshot + (nv->pages * NVRAM_PAGE), nv->start + (nv->pages * NVRAM_PAGE), length - (nv->pages * NVRAM_PAGE));
+	} else {
+		memcpy(nv->snapshot, nv->start, length);
+	}
+	pthread_mutex_unlock(&nv->lock);
+	r = nvram_write(nv, nv->snapshot);
+done:
+	if (r == 0 && !nv->child && !nv->async.busy)
+		r = nvram_wal_compact(nv, nv->image_lsn);
+	pthread_mutex_unlock(&nv->save);
+	return r;
+}
+
+/**< checkpointer thread, saves the section every 'nv->interval' milliseconds
+ * until told to stop */
+static void *nvram_checkpointer(void *arg)
+{
+	nvram_t *nv = arg;
+	struct timespec deadline;
+	pthread_mutex_lock(&nv->control);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	while (nv->running) {
+		deadline.tv_sec  += nv->interval / 1000;
+		deadline.tv_nsec += (nv->interval % 1000) * 1000000l;
+		if (deadline.tv_nsec >= 1000000000l) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000l;
+		}
+		while (nv->running && !nv->compact && pthread_cond_timedwait(&nv->wake, &nv->control, &deadline) != ETIMEDOUT)
+			;
+		if (!nv->running)
+			break;
+		pthread_mutex_unlock(&nv->control);
+		if (nvram_checkpoint(nv) < 0)
+			fprintf(stderr, "nvram checkpoint of '%s' failed\n", nv->name);
+		pthread_mutex_lock(&nv->control);
+	}
+	pthread_mutex_unlock(&nv->control);
+	return NULL;
+}
+
+/**< start a thread that saves the section every 'nv->interval' milliseconds,
+ * tracked sections are only saved once 'nv->threshold' pages are dirty */
+static int nvram_checkpoint_start(nvram_t *nv)
+{
+	pthread_condattr_t attr;
+	assert(nv);
+	assert(!nv->running);
+	assert(nv->interval);
+	if (posix_memalign((void**)&nv->snapshot, NVRAM_PAGE, nv->stop - nv->start + 1)) { /* aligned for O_DIRECT */
+		fputs("nvram snapshot allocation failed\n", stderr);
+		return -1;
+	}
+	pthread_mutex_lock(&nv->lock);
+	memcpy(nv->snapshot, nv->start, nv->stop - nv->start);
+	pthread_mutex_unlock(&nv->lock);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&nv->wake, &attr);
+	pthread_condattr_destroy(&attr);
+	nv->running = true;
+	if ((errno = pthread_create(&nv->checkpointer, NULL, nvram_checkpointer, nv))) {
+		fprintf(stderr, "nvram checkpointer creation failed: %s\n", strerror(errno));
+		nv->running = false;
+		pthread_cond_destroy(&nv->wake);
+		free(nv->snapshot);
+		nv->snapshot = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**< stop the checkpointer thread, waiting for any checkpoint in progress */
+static void nvram_checkpoint_stop(nvram_t *nv)
+{
+	assert(nv);
+	pthread_mutex_lock(&nv->control);
+	if (!nv->running) {
+		pthread_mutex_unlock(&nv->control);
+		return;
+	}
+	nv->running = false;
+	pthread_cond_signal(&nv->wake);
+	pthread_mutex_unlock(&nv->control);
+	pthread_join(nv->checkpointer, NULL);
+	pthread_cond_destroy(&nv->wake);
+	free(nv->snapshot);
+	nv->snapshot = NULL;
+}
+
+/**< Start a background save, the process forks and the child writes out its
+ * copy of the section, which the kernel shares copy-on-write with the parent,
+ * so the parent is only paused for as long as the fork takes no matter how
+ * large the section is. The child reports back over a pipe, the result is
+ * collected with 'nvram_bgsave_poll'. A mapped section is shared with the
+ * child rather than copied, so the child would not see a snapshot of it, and
+ * cannot be saved this way; save it with 'nvram_checkpoint' or 'nvram_store'.
+ * @return 0 if a save was started, 1 if one is already in progress, 0< on
+ * failure */
+static int nvram_bgsave(nvram_t *nv)
+{
+	int fds[2] = { -1, -1 };
+	struct timespec start;
+	assert(nv);
+	if (nv->fd >= 0) {
+		fprintf(stderr, "nvram section '%s' is mapped and cannot be saved in the background\n", nv->name);
+		return -1;
+	}
+	pthread_mutex_lock(&nv->save);
+	if (nv->child || nv->async.busy) {
+		pthread_mutex_unlock(&nv->save);
+		return 1;
+	}
+	if (pipe(fds) < 0) {
+		fprintf(stderr, "nvram background save pipe failed: %s\n", strerror(errno));
+		pthread_mutex_unlock(&nv->save);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	nvram_settle(nv);
+	pthread_mutex_lock(&nv->lock);
+	if (nv->dirty)
+		nvram_collect(nv, NULL);
+	nv->image_lsn = nv->bgsave.lsn = nv->lsn;
+	const pid_t pid = fork();
+	if (pid > 0) {
+		nv->child  = pid;
+		nv->report = fds[0];
+		nv->forked = start;
+		nv->rehash = true; /* the child updated its copy of the checksums, not ours */
+		nvram_history_forget(nv); /* nor is the image it saves known */
+		if (nv->ab) /* the child writes the older slot */
+			nvram_slot_advance(nv, nv->generation ? !nv->slot : 0);
+	}
+	pthread_mutex_unlock(&nv->lock);
+	pthread_mutex_unlock(&nv->save);
+
+	if (pid == 0) { /* child: write the snapshot, report, and exit without running atexit handlers */
+		struct { int status; double write; } report = { 0, 0 };
+		close(fds[0]);
+		nv->keep = 0; /* the parent keeps the history */
+		report.status = nvram_write(nv, nv->start) != 0;
+		report.write = elapsed(&start);
+		if (write(fds[1], &report, sizeof report) != sizeof report)
+			report.status = 1;
+		_exit(report.status);
+	}
+	close(fds[1]);
+	if (pid < 0) {
+		fprintf(stderr, "nvram background save fork failed: %s\n", strerror(errno));
+		close(fds[0]);
+		nvram_redirty(nv);
+		return -1;
+	}
+	nv->bgsave.pause = elapsed(&start);
+	return 0;
+}
+
+/**< check on a background save started by 'nvram_bgsave', optionally waiting
+ * for it to finish. The results are stored in 'nv->bgsave'.
+ * @return 0 if the save completed (or there was none), 1 if it is still in
+ * progress, 0< if it failed */
+static int nvram_bgsave_poll(nvram_t *nv, bool wait)
+{
+	assert(nv);
+	pthread_mutex_lock(&nv->save);
+	const int r = nvram_bgsave_reap(nv, wait);
+	pthread_mutex_unlock(&nv->save);
+	return r;
+}
+
+/**< Start saving the section without waiting for the data to be written,
+ * the section is copied (which is all the caller waits for) and written to a
+ * temporary file with a series of large writes submitted through io_uring,
+ * followed by a sync, and renamed over the file once 'nvram_async_poll' sees
+ * that they have finished. Where io_uring is unavailable the writes are done
+ * with pwrite before returning. Mapped sections and those with A/B slots are
+ * saved synchronously instead.
+ * @return 0 if a save was started, 1 if one is already in progress, 0< on failure */
+static int nvram_async_save(nvram_t *nv)
+{
+	nvram_async_t *a = &nv->async;
+	const size_t length = nv->stop - nv->start;
+	assert(nv);
+	if (nv->fd >= 0 || nv->ab || nv->compress)
+		return nvram_store(nv, false);
+
+	pthread_mutex_lock(&nv->save);
+	if (a->busy || nv->child) {
+		pthread_mutex_unlock(&nv->save);
+		return 1;
+	}
+	if (!a->probed) {
+		a->probed = true;
+		if (nvram_uring_setup(&a->ring, NVRAM_ASYNC_DEPTH * 2) < 0)
+			fputs("nvram io_uring unavailable, saving with pwrite\n", stderr);
+	}
+	const size_t count = ((length + NVRAM_ASYNC_CHUNK - 1) / NVRAM_ASYNC_CHUNK) + 3;
+	if ((!a->image && !(a->image = malloc(length + 1))) || (!a->io && !(a->io = malloc(count * sizeof a->io[0])))) {
+		fputs("nvram asynchronous save allocation failed\n", stderr);
+		pthread_mutex_unlock(&nv->save);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &a->started);
+	nvram_settle(nv);
+	pthread_mutex_lock(&nv->lock);
+	nv->image_lsn = a->lsn = nv->lsn;
+	if (nv->dirty)
+		nvram_collect(nv, NULL);
+	memcpy(a->image, nv->start, length);
+	pthread_mutex_unlock(&nv->lock);
+	nvram_history_record(nv, a->image);
+	nvram_hash(nv, a->image);
+	nvram_header(nv, &a->header, 0);
+	if ((a->fd = commit_start(nv->name, &a->tmp)) < 0) {
+		nvram_redirty(nv);
+		pthread_mutex_unlock(&nv->save);
+		return -1;
+	}
+
+	a->count = 0;
+	for (size_t offset = 0; offset < length; offset += NVRAM_ASYNC_CHUNK)
+		a->io[a->count++] = (nvram_io_t){ a->image + offset, length - offset < NVRAM_ASYNC_CHUNK ? length - offset : NVRAM_ASYNC_CHUNK, offset };
+	a->io[a->count++] = (nvram_io_t){ (char*)nv->crcs,   nvram_table_size(nv),  a->header.table };
+	a->io[a->count++] = (nvram_io_t){ (char*)nv->fields, nvram_fields_size(nv), a->header.fields };
+	a->io[a->count++] = (nvram_io_t){ (char*)&a->header, sizeof a->header,      a->header.fields + nvram_fields_size(nv) };
+	a->next = a->done = a->inflight = 0;
+	a->sync = a->synced = a->failed = false;
+	a->busy = true;
+	nvram_async_pump(nv, false);
+	pthread_mutex_unlock(&nv->save);
+	return 0;
+}
+
+/**< Make progress on the asynchronous save in progress, if any, without
+ * blocking unless 'wait' is true, in which case it waits for the save to
+ * finish. An event loop calls this whenever it is idle (or on a timer).
+ * @return 1 if the save is still in progress, 0 if it has finished (or there
+ * was none), 0< if it failed */
+static int nvram_async_poll(nvram_t *nv, bool wait)
+{
+	assert(nv);
+	pthread_mutex_lock(&nv->save);
+	const int r = nvram_async_drain(nv, wait);
+	pthread_mutex_unlock(&nv->save);
+	return r;
+}
+
+/**< Publish a mapped section to readers in other processes, the live header
+ * is created (or reused, so existing readers keep working) and filled in */
+static int nvram_share(nvram_t *nv)
+{
+	const size_t length = nv->stop - nv->start;
+	assert(nv);
+	assert(nv->fd >= 0);
+	errno = 0;
+	if (length - nv->mapped > sizeof nv->live->tail) {
+		fprintf(stderr, "nvram section '%s' is not mapped\n", nv->name);
+		return -1;
+	}
+	const int fd = open(nv->live_name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof *nv->live) < 0
+			|| (nv->live = mmap(NULL, sizeof *nv->live, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "nvram live header '%s' failed: %s\n", nv->live_name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		nv->live = NULL;
+		return -1;
+	}
+	close(fd);
+	const uint64_t sequence = nv->live->sequence | 1; /* a writer may have died whilst updating it */
+	__atomic_store_n(&nv->live->sequence, sequence, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	nv->live->length = length;
+	nv->live->layout = nv->layout;
+	nv->live->pid    = getpid();
+	memcpy(nv->live->tail, nv->start + nv->mapped, length - nv->mapped);
+	__atomic_store_n(&nv->live->magic, NVRAM_LIVE_MAGIC, __ATOMIC_RELAXED);
+	__atomic_store_n(&nv->live->sequence, sequence + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**< Start updating the variables of a section, this takes the section lock
+ * and, for a shared section, makes the sequence number odd so that readers
+ * retry any read that overlaps the update. */
+static void nvram_update_begin(nvram_t *nv)
+{
+	assert(nv);
+	pthread_mutex_lock(&nv->lock);
+	if (!nv->live)
+		return;
+	__atomic_store_n(&nv->live->sequence, nv->live->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**< Finish updating the variables of a section, copying the partial last page
+ * of a shared section for readers and making the sequence number even. */
+static void nvram_update_end(nvram_t *nv)
+{
+	assert(nv);
+	if (nv->live) {
+		memcpy(nv->live->tail, nv->start + nv->mapped, (nv->stop - nv->start) - nv->mapped);
+		__atomic_store_n(&nv->live->sequence, nv->live->sequence + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&nv->lock);
+}
+
+/**< Open a section shared by another process for reading, given its image
+ * file 'name' and its live header 'live_name'. Both are mapped read only,
+ * reads are then made without locks or system calls.
+ * @return 0 on success, 0< on failure */
+static int nvram_reader_open(nvram_reader_t *r, const char *name, const char *live_name)
+{
+	int fd = -1;
+	void *live = MAP_FAILED, *image = MAP_FAILED;
+	assert(r);
+	assert(name);
+	assert(live_name);
+	memset(r, 0, sizeof *r);
+	errno = 0;
+	if ((fd = open(live_name, O_RDONLY)) < 0
+			|| (live = mmap(NULL, sizeof *r->live, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto fail;
+	close(fd);
+	r->live   = live;
+	r->length = r->live->length;
+	r->whole  = r->length & ~((size_t)NVRAM_PAGE - 1);
+	if (__atomic_load_n(&r->live->magic, __ATOMIC_ACQUIRE) != NVRAM_LIVE_MAGIC) {
+		fprintf(stderr, "nvram live header '%s' is not valid\n", live_name);
+		fd = -1;
+		goto fail;
+	}
+	if ((fd = open(name, O_RDONLY)) < 0
+			|| (r->whole && (image = mmap(NULL, r->whole, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+		goto fail;
+	close(fd);
+	r->image = image == MAP_FAILED ? NULL : image;
+	return 0;
+fail:
+	if (errno)
+		fprintf(stderr, "nvram reader of '%s' failed: %s\n", name, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	if (live != MAP_FAILED)
+		munmap(live, sizeof *r->live);
+	memset(r, 0, sizeof *r);
+	return -1;
+}
+
+static void nvram_reader_close(nvram_reader_t *r)
+{
+	assert(r);
+	if (r->image)
+		munmap((void*)r->image, r->whole);
+	if (r->live)
+		munmap((void*)r->live, sizeof *r->live);
+	memset(r, 0, sizeof *r);
+}
+
+/**< Copy 'length' bytes at 'offset' in a shared section into 'buffer', the
+ * copy is retried until no update overlapped it, so it is consistent with
+ * itself (all of the variables read come from the same update). Only a
+ * reader that keeps colliding with the writer makes a system call, to yield
+ * to it in case it was preempted in the middle of an update.
+ * @return 0 on success, 1 if the writer was busy for too long, 0< on failure */
+static int nvram_reader_read(nvram_reader_t *r, size_t offset, void *buffer, size_t length)
+{
+	assert(r);
+	assert(buffer);
+	if (offset > r->length || length > r->length - offset)
+		return -1;
+	const size_t split = offset >= r->whole ? 0 : r->whole - offset < length ? r->whole - offset : length;
+	for (unsigned long spins = 0; spins < NVRAM_LIVE_SPINS; spins++) {
+		const uint64_t sequence = __atomic_load_n(&r->live->sequence, __ATOMIC_ACQUIRE);
+		if (!(sequence & 1)) {
+			if (split)
+				memcpy(buffer, r->image + offset, split);
+			if (length > split)
+				memcpy((char*)buffer + split, r->live->tail + (offset + split - r->whole), length - split);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&r->live->sequence, __ATOMIC_RELAXED) == sequence) {
+				r->reads++;
+				return 0;
+			}
+		}
+		if (++r->retries % NVRAM_LIVE_YIELD == 0)
+			sched_yield();
+	}
+	return 1;
+}
+
+/**< @return what the self relative pointer 'p' points to, NULL if nothing */
+static inline void *nvram_ptr_get(const volatile nvram_ptr_t *p)
+{
+	assert(p);
+	return *p ? (void*)((uintptr_t)p + *p) : NULL;
+}
+
+/**< point the self relative pointer 'p' at 'target', which may be NULL */
+static inline void nvram_ptr_set(volatile nvram_ptr_t *p, const volatile void *target)
+{
+	assert(p);
+	*p = target ? (intptr_t)target - (intptr_t)p : 0;
+}
+
+/**< Check the header of an arena, which is 'length' bytes long (the size of
+ * the variable declared with 'NVRAM_ARENA'), once its section is loaded.
+ * The header is taken from the file, so it is not trusted; an arena whose
+ * size, top or free lists are out of bounds is emptied.
+ * @return 0 if the arena is valid, 1 if it was emptied, in which case any
+ * pointers into it must be discarded */
+static int nvram_arena_attach(volatile nvram_arena_t *arena, size_t length)
+{
+	nvram_arena_t *a = (nvram_arena_t*)arena;
+	bool valid = a->size == length && a->top >= sizeof *a && a->top <= a->size
+		&& a->top % sizeof (uint64_t) == 0 && a->used <= a->top - sizeof *a;
+	assert(a);
+	assert(length >= sizeof *a);
+	for (unsigned c = 0; valid && c < NVRAM_ARENA_CLASSES; c++)
+		valid = !a->free[c] || (a->free[c] >= sizeof *a && a->free[c] % sizeof (uint64_t) == 0
+				&& (1ull << c) <= a->top && a->free[c] <= a->top - (1ull << c));
+	if (valid)
+		return 0;
+	fprintf(stderr, "nvram arena at %p corrupt, emptying it\n", (void*)a);
+	memset(a, 0, sizeof *a);
+	a->size = length;
+	a->top  = sizeof *a;
+	return 1;
+}
+
+/**< Allocate 'size' bytes, aligned to 8 bytes, from an arena. The size is
+ * rounded up to a size class, a block is taken from the list of free blocks
+ * for the class or cut from the end of the arena, so this takes the same
+ * time however full the arena is. Arenas are NVRAM variables, so they must
+ * only be used whilst the lock for their section is held.
+ * @return the allocation, or NULL if the arena is full */
+static void *nvram_alloc(volatile nvram_arena_t *arena, size_t size)
+{
+	nvram_arena_t *a = (nvram_arena_t*)arena;
+	char *base = (char*)a;
+	assert(a);
+	if (!size || size > a->size || size > SIZE_MAX - sizeof (uint64_t))
+		return NULL;
+	unsigned c = 64 - __builtin_clzll(size + sizeof (uint64_t) - 1);
+	c = c < NVRAM_ARENA_MIN ? NVRAM_ARENA_MIN : c;
+	if (c >= NVRAM_ARENA_CLASSES) /* 'size' is only bounded by 'a->size' */
+		return NULL;
+	const uint64_t block = 1ull << c;
+	uint64_t at = a->free[c];
+	if (at) {
+		if (at < sizeof *a || at > a->top - block || at % sizeof (uint64_t)) {
+			fprintf(stderr, "nvram arena free list %u corrupt\n", c);
+			return NULL;
+		}
+		memcpy(&a->free[c], base + at + sizeof (uint64_t), sizeof a->free[c]);
+	} else {
+		if (a->top > a->size || block > a->size - a->top)
+			return NULL;
+		at = a->top;
+		a->top += block;
+	}
+	const uint64_t tag = NVRAM_BLOCK_TAG | c;
+	memcpy(base + at, &tag, sizeof tag);
+	a->used += block;
+	return base + at + sizeof tag;
+}
+
+/**< return an allocation made by 'nvram_alloc' to its arena, its block is
+ * kept for the next allocation of the same size class */
+static void nvram_free(volatile nvram_arena_t *arena, void *p)
+{
+	nvram_arena_t *a = (nvram_arena_t*)arena;
+	char *base = (char*)a;
+	uint64_t tag = 0;
+	assert(a);
+	if (!p)
+		return;
+	const uint64_t at = (char*)p - base - sizeof tag;
+	if ((char*)p < base + sizeof *a + sizeof tag || at >= a->top)
+		goto bad;
+	memcpy(&tag, base + at, sizeof tag);
+	const unsigned c = tag & 0xFF;
+	if ((tag & ~(uint64_t)0xFF) != NVRAM_BLOCK_TAG || c >= NVRAM_ARENA_CLASSES)
+		goto bad;
+	tag = 0; /* a second free is caught */
+	memcpy(base + at, &tag, sizeof tag);
+	memcpy(base + at + sizeof tag, &a->free[c], sizeof a->free[c]);
+	a->free[c] = at;
+	a->used -= 1ull << c;
+	return;
+bad:
+	fprintf(stderr, "nvram free of %p, which is not allocated from the arena\n", p);
+}
+
+/**< @return bit 'i' is set if control byte 'i' of a group equals 'tag' */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+static inline uint32_t nvram_group_match(const uint8_t *control, uint8_t tag)
+{
+	const __m128i group = _mm_loadu_si128((const __m128i*)control);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+#else
+static inline uint32_t nvram_group_match(const uint8_t *control, uint8_t tag)
+{
+	uint32_t match = 0;
+	for (unsigned i = 0; i < NVRAM_GROUP; i++)
+		match |= (uint32_t)(control[i] == tag) << i;
+	return match;
+}
+#endif
+
+/**< The hash of a key, its bits are well mixed so the low bits can be used
+ * for the tag and the rest to pick the group. It must not change, as it
+ * places the entries of the maps that are saved. */
+static inline uint64_t nvram_map_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccduLL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53uLL;
+	key ^= key >> 33;
+	return key;
+}
+
+/**< Find 'key' in a map, if it is not there then '*vacant' is set to the
+ * first slot it could be added in, or -1 if there is none.
+ * @return slot holding 'key', or -1 if it is not in the map */
+static long nvram_map_probe(const nvram_map_t *m, uint64_t key, long *vacant)
+{
+	const uint8_t *control = (const uint8_t*)(m + 1);
+	const nvram_entry_t *entry = (const nvram_entry_t*)(control + m->groups * NVRAM_GROUP);
+	const uint64_t hash = nvram_map_hash(key);
+	const uint8_t tag = NVRAM_FULL | (hash & 0x7F);
+	const uint64_t mask = m->groups - 1;
+	*vacant = -1;
+	if (!m->groups || (m->groups & mask)) {
+		fprintf(stderr, "nvram map has %"PRIu64" groups, which is not a power of two\n", m->groups);
+		return -1;
+	}
+	uint64_t g = (hash >> 7) & mask;
+	for (uint64_t i = 1; i <= m->groups; g = (g + i++) & mask) { /* visits every group */
+		const uint8_t *c = control + g * NVRAM_GROUP;
+		for (uint32_t match = nvram_group_match(c, tag); match; match &= match - 1) {
+			const long slot = g * NVRAM_GROUP + __builtin_ctz(match);
+			if (entry[slot].key == key)
+				return slot;
+		}
+		const uint32_t empty = nvram_group_match(c, NVRAM_EMPTY);
+		const uint32_t tomb = nvram_group_match(c, NVRAM_TOMB);
+		if (*vacant < 0 && (empty | tomb))
+			*vacant = g * NVRAM_GROUP + __builtin_ctz(empty | tomb);
+		if (empty)
+			break;
+	}
+	return -1;
+}
+
+/**< Look up 'key' in a map, like arenas maps are NVRAM variables and must
+ * only be used whilst the lock for their section is held.
+ * @return the value of 'key', which can be updated, or NULL if it is not in the map */
+static volatile uint64_t *nvram_map_get(volatile nvram_map_t *map, uint64_t key)
+{
+	nvram_map_t *m = (nvram_map_t*)map;
+	long vacant = -1;
+	assert(m);
+	const long slot = nvram_map_probe(m, key, &vacant);
+	if (slot < 0)
+		return NULL;
+	nvram_entry_t *entry = (nvram_entry_t*)((uint8_t*)(m + 1) + m->groups * NVRAM_GROUP);
+	return &entry[slot].value;
+}
+
+/**< Set the value of 'key' in a map, adding it if it is not there. A map is
+ * not allowed to become more than 7/8 full (counting the slots of removed
+ * entries that cannot be reused yet) as probing gets slower as it fills.
+ * @return 0 on success, -1 if the map is full */
+static int nvram_map_put(volatile nvram_map_t *map, uint64_t key, uint64_t value)
+{
+	nvram_map_t *m = (nvram_map_t*)map;
+	long vacant = -1;
+	assert(m);
+	uint8_t *control = (uint8_t*)(m + 1);
+	nvram_entry_t *entry = (nvram_entry_t*)(control + m->groups * NVRAM_GROUP);
+	long slot = nvram_map_probe(m, key, &vacant);
+	if (slot < 0) {
+		if (vacant < 0)
+			return -1;
+		const bool tomb = control[vacant] == NVRAM_TOMB;
+		if (!tomb && m->count + m->tombs >= m->groups * NVRAM_GROUP / 8 * 7)
+			return -1;
+		slot = vacant;
+		m->tombs -= tomb;
+		m->count++;
+		entry[slot].key = key;
+		control[slot] = NVRAM_FULL | (nvram_map_hash(key) & 0x7F);
+	}
+	entry[slot].value = value;
+	return 0;
+}
+
+/**< remove 'key' from a map, its slot is made empty if no probe can have
+ * passed over it, that is if its group has an empty slot
+ * @return true if 'key' was in the map */
+static bool nvram_map_remove(volatile nvram_map_t *map, uint64_t key)
+{
+	nvram_map_t *m = (nvram_map_t*)map;
+	long vacant = -1;
+	assert(m);
+	uint8_t *control = (uint8_t*)(m + 1);
+	const long slot = nvram_map_probe(m, key, &vacant);
+	if (slot < 0)
+		return false;
+	const bool empty = nvram_group_match(control + (slot / NVRAM_GROUP) * NVRAM_GROUP, NVRAM_EMPTY) != 0;
+	control[slot] = empty ? NVRAM_EMPTY : NVRAM_TOMB;
+	m->tombs += !empty;
+	m->count--;
+	return true;
+}
+
+/**< @return checksum of an event at position 'sequence - 1' holding 'length' bytes of 'data' */
+static uint32_t nvram_event_crc(uint64_t sequence, const void *data, uint32_t length)
+{
+	return nvram_crc32c(nvram_crc32c(0, &sequence, sizeof sequence), data, length);
+}
+
+/**< Add an event of 'length' bytes to a ring, this does not take a lock
+ * and can be called from any number of threads at once, in a tracked
+ * section too as 'nvram_fault' never leaves a page writable without it being
+ * marked dirty. An event that is being written when the section is saved is
+ * saved incomplete, so each event has a checksum, and the position that it
+ * was written at so that an old event in the same slot is not mistaken for
+ * it. If two threads write to the same slot at once, which can only happen
+ * if one has been held up for as long as it takes to go around the ring,
+ * the checksum catches that too.
+ * @return 0 on success, -1 if the event is too large */
+static int nvram_ring_push(volatile nvram_ring_t *ring, const void *data, size_t length)
+{
+	assert(ring);
+	assert(data || !length);
+	if (length > NVRAM_EVENT || !ring->slots)
+		return -1;
+	const uint64_t at = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	nvram_event_t *e = (nvram_event_t*)(ring + 1) + at % ring->slots;
+	__atomic_store_n(&e->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE); /* the slot is marked as being written before it is */
+	memcpy(e->data, data, length);
+	e->length = length;
+	e->crc = nvram_event_crc(at + 1, data, length);
+	__atomic_store_n(&e->sequence, at + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**< Copy the event at position '*position' in a ring into 'event', skipping
+ * positions that have been overwritten or whose event is incomplete. The
+ * oldest event kept is read if '*position' is older than that, so 0 starts
+ * from the beginning, and '*position' is left after the event read.
+ * @return true if an event was read, false if there are no more */
+static bool nvram_ring_next(const volatile nvram_ring_t *ring, uint64_t *position, nvram_event_t *event)
+{
+	assert(ring);
+	assert(position);
+	assert(event);
+	const nvram_event_t *slot = (const nvram_event_t*)(ring + 1);
+	for (;;) {
+		const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (*position + ring->slots < head)
+			*position = head - ring->slots;
+		if (*position >= head || !ring->slots)
+			return false;
+		const uint64_t at = (*position)++;
+		const nvram_event_t *e = &slot[at % ring->slots];
+		if (__atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE) != at + 1)
+			continue;
+		memcpy(event, e, sizeof *event);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE); /* the copy is made before the slot is checked again */
+		if (__atomic_load_n(&e->sequence, __ATOMIC_RELAXED) == at + 1 && event->length <= NVRAM_EVENT &&
+				nvram_event_crc(at + 1, event->data, event->length) == event->crc)
+			return true;
+	}
+}
+
+/**< Check the events of a ring after it has been loaded, those that were
+ * incomplete when it was saved are cleared and counted in 'torn', as they
+ * would be skipped anyway it is only needed to find out how many there are.
+ * @return number of events that were torn */
+static uint64_t nvram_ring_check(volatile nvram_ring_t *ring)
+{
+	uint64_t torn = 0;
+	assert(ring);
+	nvram_event_t *slot = (nvram_event_t*)(ring + 1);
+	const uint64_t head = ring->head;
+	for (uint64_t at = head > ring->slots ? head - ring->slots : 0; at < head; at++) {
+		nvram_event_t *e = &slot[at % ring->slots];
+		if (e->sequence == at + 1 && e->length <= NVRAM_EVENT && nvram_event_crc(at + 1, e->data, e->length) == e->crc)
+			continue;
+		e->sequence = 0;
+		torn++;
+	}
+	ring->torn += torn;
+	return torn;
+}
+
+/**< function to register with atexit, this saves every section to disk */
+static void nvram_save(void)
+{
+	for (nvram_t *const *s = __start_nvram_sections; s < __stop_nvram_sections; s++) {
+		nvram_t *nv = *s;
+		nvram_checkpoint_stop(nv);
+		nvram_bgsave_poll(nv, true);
+		nvram_async_poll(nv, true);
+		fprintf(stderr, "saving nvram to '%s'\n", nv->name);
+		if (nvram_store(nv, true))
+			fprintf(stderr, "nvram block save failed: '%s'\n", nv->name);
+	}
+}
+
+/**< Keep a copy of the default values of the section, to be restored if the
+ * file holds no valid data. When loading lazily the whole pages are moved
+ * rather than copied, which leaves the section mapped to the executable (so
+ * it reads back the same defaults) and means the copy is only read in if it
+ * is used, however large the section is. '*reserved' is set to the size of
+ * the mapping holding the copy, or 0 if it was allocated.
+ * @return copy of the defaults, NULL on failure */
+static char *nvram_defaults(nvram_t *nv, size_t *reserved)
+{
+	const size_t length = nv->stop - nv->start;
+	const size_t whole  = nv->pages * NVRAM_PAGE;
+	char *defaults = NULL;
+	assert(nv);
+	assert(reserved);
+	*reserved = 0;
+#ifdef MREMAP_DONTUNMAP
+	if (nv->lazy && whole) {
+		char *copy = mmap(NULL, whole + NVRAM_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (copy != MAP_FAILED && mremap(nv->start, whole, whole, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, copy) != MAP_FAILED) {
+			memcpy(copy + whole, nv->start + whole, length - whole);
+			*reserved = whole + NVRAM_PAGE;
+			return copy;
+		}
+		if (copy != MAP_FAILED) /* older kernels cannot move file mappings, copy instead */
+			munmap(copy, whole + NVRAM_PAGE);
+	}
+#endif
+	if ((defaults = malloc(length + 1)))
+		memcpy(defaults, nv->start, length);
+	return defaults;
+}
+
+static void nvram_defaults_free(char *defaults, size_t reserved)
+{
+	if (reserved)
+		munmap(defaults, reserved);
+	else
+		free(defaults);
+}
+
+/**< load in the variables of a section, replay its journal and start
+ * tracking it, as set by its policy
+ * @return 0< fatal error, 0 = okay, 1 = warning */
+static int nvram_section_initialize(nvram_t *nv)
+{
+	int r = 0;
+	assert(nv);
+
+	if (nv->map && nv->ab) {
+		fprintf(stderr, "nvram section '%s' cannot be both mapped and use A/B slots\n", nv->name);
+		return -1;
+	}
+
+	if (nv->shared) /* readers map the image file */
+		nv->map = true;
+	if ((nv->keep || nv->rollback) && (nv->map || nv->lazy)) {
+		fprintf(stderr, "nvram section '%s' cannot keep a history if it is mapped or lazily loaded\n", nv->name);
+		return -1;
+	}
+	if (nv->compress && (nv->map || nv->lazy || nv->ab)) {
+		fprintf(stderr, "nvram section '%s' cannot be compressed if it is mapped, lazily loaded or uses A/B slots\n", nv->name);
+		return -1;
+	}
+	if (nv->rollback && nv->journal) {
+		fprintf(stderr, "nvram section '%s' cannot be rolled back whilst it has a journal to replay\n", nv->name);
+		return -1;
+	}
+	if (nv->lazy && nv->verify == NVRAM_VERIFY_LOAD) /* verifying every page on load would read them all in */
+		nv->verify = NVRAM_VERIFY_DEFER;
+
+	nv->pages  = (nv->stop - nv->start) / NVRAM_PAGE;
+	nv->chunks = (nv->stop - nv->start + NVRAM_PAGE - 1) / NVRAM_PAGE;
+	nv->rehash = true;
+	if (nvram_describe(nv) < 0)
+		return -1;
+	size_t reserved = 0;
+	char *defaults = nvram_defaults(nv, &reserved);
+	if (!defaults || !(nv->crcs = calloc(nv->chunks + 1, sizeof nv->crcs[0]))) {
+		fputs("nvram defaults allocation failed\n", stderr);
+		nvram_defaults_free(defaults, reserved);
+		return -1;
+	}
+	if (nv->map)
+		r = nvram_map(nv, defaults);
+	else
+		r = nvram_load(nv, defaults);
+	nvram_defaults_free(defaults, reserved);
+	if (r < 0)
+		return -1;
+
+	const int rolled = nv->keep || nv->rollback ? nvram_history_open(nv) : 0;
+	if (rolled < 0)
+		return -1;
+	const long replayed = nv->journal ? nvram_wal_replay(nv) : 0;
+	if (replayed < 0)
+		return -1;
+	if (nv->journal) {
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&nv->wal_done, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+
+	if (nv->track && !nv->map && nvram_track(nv, r != 0 || rolled || replayed) < 0)
+		return -1;
+	if (nv->shared && nvram_share(nv) < 0)
+		return -1;
+	return r;
+}
+
+/**< register save call back atexit and load in the NVRAM variables of every
+ * section, each section has its own file and policy
+ * @return 0< fatal error, 0 = okay, 1 = warning */
+static int nvram_initialize(void)
+{
+	int r = 0;
+	uint64_t format = nv_format;
+	uint64_t version = nv_version;
+
+	nvram_crc32c_init(); /* before 'nvram_fault' can be installed, it calls 'nvram_crc32c_update' */
+	for (nvram_t *const *s = __start_nvram_sections; s < __stop_nvram_sections; s++) {
+		const int sr = nvram_section_initialize(*s);
+		if (sr < 0)
+			return -1;
+		r |= sr;
+	}
+
+	if (format != nv_format) {
+		fprintf(stderr, "file format/endianess incompatibility: expected %"PRIx64 " - actual %"PRIx64"\n", format, nv_version);
+		return -1;
+	}
+	if (version != nv_version) {
+		fprintf(stderr, "version incompatibility: expected %"PRIx64 " - actual %"PRIx64"\n", version, nv_version);
+		return -1;
+	}
+
+	if (atexit(nvram_save)) {
+		fputs("atexit: failed to register nvram_save\n", stderr);
+		return -1;
+	}
+
+	for (nvram_t *const *s = __start_nvram_sections; s < __stop_nvram_sections; s++)
+		if ((*s)->interval && nvram_checkpoint_start(*s) < 0)
+			return -1;
+	return r;
+}
+
+/* ======= Utility Functions =============================================== */
+
+/* ======= Test Program ==================================================== */
+/* A simple test program for the techniques described above, it prints the
+ * default values for NVRAM variables, initializes the NVRAM and registers the
+ * save callback, and allows the user to update values which will be saved to
+ * disk on exit. Passing "-m" maps the NVRAM file instead of loading it, "-t"
+ * tracks which pages are modified so only those are saved, "-d" sets how
+ * durable each save is, "-c" saves the variables periodically in the
+ * background, "-b" saves them from a forked child process, "-a" alternates
+ * saves between two slots in the file, "-v" defers verifying the data until
+ * it is used, "-l" also defers reading it and "-j" journals each update, with
+ * "-w" grouping the journal writes, "-u" saves them asynchronously and "-o"
+ * bypasses the page cache, "-s" shares the variables with processes run with
+ * "-r", which read them as they change, "-k" keeps the changes made by the
+ * last few saves and "-g" goes back to an earlier save, "-z" compresses
+ * the file and "-n" loads and saves it with several threads, "-x" kills the
+ * program before it can save, to test recovery from a crash. The options
+ * apply to the default
+ * section, the run count is kept in a second section with a policy of its
+ * own. */
+#define HISTORY (4) /**< number of previous values kept in 'nv_history' */
+
+/**< an entry in 'nv_history', allocated from 'nv_arena' */
+typedef struct {
+	nvram_ptr_t next; /**< older entry */
+	int32_t a, b;     /**< values given */
+} history_t;
+
+/**< count the times 'a' is in 'nv_history' in 'nv_seen', 'delta' is 1 or -1 */
+static void seen(int32_t a, int delta)
+{
+	volatile uint64_t *count = nvram_map_get(&nv_seen.map, (uint32_t)a);
+	if (count && *count + delta == 0)
+		nvram_map_remove(&nv_seen.map, (uint32_t)a);
+	else if (count)
+		*count += delta;
+	else if (delta > 0 && nvram_map_put(&nv_seen.map, (uint32_t)a, 1) < 0)
+		fputs("nvram map 'nv_seen' is full\n", stderr);
+}
+
+/**< add the values given to the front of 'nv_history', and free the entries
+ * that are too old to keep, the section lock must be held */
+static void remember(int32_t a, int32_t b)
+{
+	history_t *h = nvram_alloc(&nv_arena.arena, sizeof *h), *last = NULL;
+	if (!h)
+		return;
+	seen(a, 1);
+	h->a = a;
+	h->b = b;
+	nvram_ptr_set(&h->next, nvram_ptr_get(&nv_history));
+	nvram_ptr_set(&nv_history, h);
+	for (int i = 0; h; i++, last = h, h = nvram_ptr_get(&h->next))
+		if (i == HISTORY) {
+			nvram_ptr_set(&last->next, NULL);
+			for (history_t *old = h; old; old = h) {
+				h = nvram_ptr_get(&old->next);
+				seen(old->a, -1);
+				nvram_free(&nv_arena.arena, old);
+			}
+			break;
+		}
+}
+
+/**< read the default section, shared by another instance of the program
+ * with "-s", 'count' times and check that 'c = a + b' in every copy */
+static int monitor(unsigned long count)
+{
+	nvram_reader_t r;
+	unsigned long inconsistent = 0;
+	int32_t a = 0, b = 0, c = 0;
+	if (nvram_describe(&nvram_section) < 0 || nvram_reader_open(&r, nvram_section.name, nvram_section.live_name) < 0)
+		return -1;
+	char *copy = malloc(r.length + 1);
+	if (!copy || r.live->layout != nvram_section.layout) {
+		fputs(copy ? "nvram monitor: layout differs\n" : "nvram monitor: allocation failed\n", stderr);
+		free(copy);
+		nvram_reader_close(&r);
+		return -1;
+	}
+	for (unsigned long i = 0; i < count; i++) {
+		if (nvram_reader_read(&r, 0, copy, r.length)) {
+			fprintf(stderr, "nvram monitor: writer (pid %u) is not finishing its update\n", (unsigned)r.live->pid);
+			break;
+		}
+		memcpy(&a, copy + ((const volatile char*)&nv_a - nvram_section.start), sizeof a);
+		memcpy(&b, copy + ((const volatile char*)&nv_b - nvram_section.start), sizeof b);
+		memcpy(&c, copy + ((const volatile char*)&nv_c - nvram_section.start), sizeof c);
+		inconsistent += c != a + b;
+	}
+	printf("live a:      %d\nlive b:      %d\nlive c:      %d\n", (int)a, (int)b, (int)c);
+	printf("monitor: %lu reads, %lu retries, %lu inconsistent\n", r.reads, r.retries, inconsistent);
+	free(copy);
+	nvram_reader_close(&r);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt = 0;
+	int32_t a = 0, b = 0;
+	uint64_t lsn = 0;
+	bool background = false, async = false, crash = false;
+	unsigned long reads = 0;
+	while ((opt = getopt(argc, argv, "mtbavljuoszxd:c:p:w:r:k:g:n:")) != -1) {
+		switch (opt) {
+		case 'v': nvram_section.verify = NVRAM_VERIFY_DEFER; break;
+		case 'l': nvram_section.lazy = true; break;
+		case 'j': nvram_section.journal = true; break;
+		case 'w': nvram_section.window = atoi(optarg); break;
+		case 'm': nvram_section.map = true; break;
+		case 'a': nvram_section.ab = true; break;
+		case 't': nvram_section.track = true; break;
+		case 'd': nvram_section.durability = atoi(optarg); break;
+		case 'c': nvram_section.interval = atoi(optarg); break;
+		case 'p': nvram_section.threshold = atoi(optarg); break;
+		case 'b': background = true; break;
+		case 'u': async = true; break;
+		case 'o': nvram_section.direct = true; break;
+		case 's': nvram_section.shared = true; break;
+		case 'r': reads = strtoul(optarg, NULL, 0); break;
+		case 'k': nvram_section.keep = atoi(optarg); break;
+		case 'g': nvram_section.rollback = atoi(optarg); break;
+		case 'z': nvram_section.compress = true; break;
+		case 'n': nvram_section.threads = atoi(optarg); break;
+		case 'x': crash = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-mtbavljuoszx] [-d 0-2] [-c ms] [-p pages] [-w us] [-r reads] [-k saves] [-g saves] [-n threads]\n"
+					"\t-m\tmap 'nvram.blk' instead of copying it\n"
+					"\t-t\tonly save pages that have been written to\n"
+					"\t-d\tdurability; 0 = in place, 1 = atomic, 2 = atomic and durable\n"
+					"\t-c\tcheckpoint interval in milliseconds\n"
+					"\t-p\tdirty pages needed before checkpointing a tracked section\n"
+					"\t-b\tsave in a forked child process after updating the variables, not with -m or -s\n"
+					"\t-u\tsave asynchronously (with io_uring) after updating the variables\n"
+					"\t-a\talternate saves between two checksummed slots in 'nvram.blk'\n"
+					"\t-v\tverify each page when it is first used instead of on load\n"
+					"\t-l\tread in each page when it is first used, implies -v\n"
+					"\t-o\tbypass the page cache (O_DIRECT) when saving and loading\n"
+					"\t-j\tjournal each update to 'nvram.blk.wal' as it is made\n"
+					"\t-w\tmicroseconds to wait for more journal records before writing them\n"
+					"\t-s\tshare the mapped 'nvram.blk' with readers in other processes, implies -m\n"
+					"\t-r\tread the variables shared by another process this many times and exit\n"
+					"\t-k\tkeep the changes made by this many saves in 'nvram.blk.hist'\n"
+					"\t-g\tgo back this many saves, using the changes kept with -k\n"
+					"\t-z\tcompress 'nvram.blk'\n"
+					"\t-n\tthreads to load and save 'nvram.blk' with\n"
+					"\t-x\tkill the program after updating the variables, so nothing is saved\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if (reads) /* this process is only a reader, another owns the files */
+		return monitor(reads) < 0 ? -1 : 0;
+	if (background && (nvram_section.map || nvram_section.shared)) {
+		fputs("-b cannot be used with -m or -s, a mapped section is not copied by fork\n", stderr);
+		return -1;
+	}
+
+	/* the options above apply to the default section, the hot section
+	 * holds only the count and has its own policy; it is checkpointed every
+	 * 10 milliseconds if it has changed, without syncing the directory, and
+	 * is small enough to verify as it is loaded */
+	nvram_hot_section.interval   = 10;
+	nvram_hot_section.track      = true;
+	nvram_hot_section.threshold  = 1;
+	nvram_hot_section.durability = NVRAM_DURABLE_FAST;
+	nvram_hot_section.verify     = NVRAM_VERIFY_LOAD;
+
+	/* default values can be accessed before nvram_initialize is called */
+	printf("default a:   %d\n", (int)nv_a);
+	printf("default b:   %d\n", (int)nv_b);
+	printf("default c:   %d\n", (int)nv_c);
+
+	/* loads in variables off disk and registers nvram_initialize */
+	if(nvram_initialize() < 0)
+		return -1;
+
+	nvram_update_begin(&nvram_section);
+	if (nvram_arena_attach(&nv_arena.arena, sizeof nv_arena)) { /* the history went with it */
+		nv_history = 0;
+		memset((void*)nv_seen.control, 0, sizeof nv_seen.control);
+		nv_seen.map.count = nv_seen.map.tombs = 0;
+	}
+	nvram_update_end(&nvram_section);
+
+	nvram_update_begin(&nvram_hot_section);
+	nv_count++; /* saved to 'hot.blk' by its checkpointer, 'nvram.blk' is left alone */
+	nvram_update_end(&nvram_hot_section);
+	printf("count:       %u\n", (unsigned)(nv_count - 1));
+	printf("loaded a:    %d\n", (int)nv_a);
+	printf("loaded b:    %d\n", (int)nv_b);
+	printf("loaded c:    %d\n", (int)nv_c);
+	fputs("history:    ", stdout);
+	for (history_t *h = nvram_ptr_get(&nv_history); h; h = nvram_ptr_get(&h->next))
+		printf(" %d+%d", (int)h->a, (int)h->b);
+	printf(" (%u bytes allocated)\n", (unsigned)nv_arena.arena.used);
+	const uint64_t torn = nvram_ring_check(&nv_events.ring);
+	printf("events:      %u, %u incomplete\n", (unsigned)nv_events.ring.head, (unsigned)torn);
+	nvram_event_t e;
+	for (uint64_t position = 0; nvram_ring_next(&nv_events.ring, &position, &e);)
+		printf("\t%u: %.*s\n", (unsigned)(position - 1), (int)e.length, e.data);
+	char event[NVRAM_EVENT];
+	nvram_ring_push(&nv_events.ring, event, snprintf(event, sizeof event, "run %u started", (unsigned)(nv_count - 1)));
+
+	/* accept some user input and do some calculations, variables are only
+	 * updated between 'nvram_update_begin' and 'nvram_update_end' so that
+	 * checkpoints, and readers of a shared section, see them consistently */
+	fputs("a new value: ", stdout);
+	scanf("%" SCNd32, &a);
+	fputs("b new value: ", stdout);
+	scanf("%" SCNd32, &b);
+	nvram_update_begin(&nvram_section);
+	nv_a = a;
+	nv_b = b;
+	nv_c = nv_a + nv_b;
+	remember(a, b);
+	if (nvram_section.journal) {
+		nvram_wal_append(&nvram_section, &nv_a, sizeof nv_a);
+		nvram_wal_append(&nvram_section, &nv_b, sizeof nv_b);
+		lsn = nvram_wal_append(&nvram_section, &nv_c, sizeof nv_c);
+	}
+	nvram_update_end(&nvram_section);
+	if (lsn && nvram_wal_commit(&nvram_section, lsn) < 0) /* all three records in one write */
+		return -1;
+	printf("c = a + b\nc = %d\n", (int)nv_c);
+	if (crash) { /* as if the program crashed, 'atexit' handlers do not run */
+		fflush(stdout);
+		raise(SIGKILL);
+	}
+	nvram_ring_push(&nv_events.ring, event, snprintf(event, sizeof event, "a = %d, b = %d", (int)a, (int)b));
+	const volatile uint64_t *seen = nvram_map_get(&nv_seen.map, (uint32_t)a);
+	printf("a = %d is in the history %u times, with %u other values\n",
+			(int)a, seen ? (unsigned)*seen : 0u, (unsigned)nv_seen.map.count - !!seen);
+
+	if (background && nvram_bgsave(&nvram_section) == 0 && nvram_bgsave_poll(&nvram_section, true) == 0)
+		printf("background save: paused %.6fs, wrote in %.6fs, finished in %.6fs\n",
+				nvram_section.bgsave.pause, nvram_section.bgsave.write, nvram_section.bgsave.total);
+
+	if (async && nvram_async_save(&nvram_section) == 0) {
+		unsigned long polls = 1;
+		int r = 0;
+		while ((r = nvram_async_poll(&nvram_section, false)) > 0) /* an event loop would do other work here */
+			polls++;
+		printf("asynchronous save: %s with %s, %lu polls, finished in %.6fs\n", r ? "failed" : "succeeded",
+				nvram_section.async.ring.fd >= 0 ? "io_uring" : "pwrite", polls, nvram_section.async.total);
+	}
+
+	if (nvram_section.journal) {
+		const nvram_wal_stats_t *w = &nvram_section.wal_stats;
+		printf("journal: %lu commits waited %.6fs on average (worst %.6fs), %lu batches of %.1f records (largest %lu)\n",
+				w->commits, w->commits ? w->latency / w->commits : 0, w->worst,
+				w->batches, w->batches ? (double)w->records / w->batches : 0, w->largest);
+	}
 
 	/* We do not have to worry about calling nvram_save, atexit will */
 
@@ -0,0 +1,116 @@
+/**@file nvram.h
+ * @license MIT
+ * @author Richard James Howe
+ * @copyright Richard James Howe (2017)
+ * @brief The format of the files written by 'nvram.c', shared with the tools
+ * that read them (see 'nvram_image.c' and 'inspect.c'). Everything is stored
+ * in the byte order of the machine that wrote it. */
+#ifndef NVRAM_H
+#define NVRAM_H
+
+#include <stdint.h>
+
+#define NVRAM_PAGE  (4096)                  /**< NVRAM is aligned to this, must be a multiple of the OS page size */
+#define NVRAM_MAGIC (0x544f4c534d41524eULL) /**< "NRAMSLOT", marks a valid slot header */
+#define NVRAM_OPEN_MAGIC (0x4e45504f4d41524eULL) /**< "NRAMOPEN", marks a valid trailer of a mapped file still in use */
+
+/**< type of an NVRAM variable, as recorded in its layout descriptor */
+typedef enum {
+	NVRAM_T_BLOB, /**< anything else; arrays, structures, ... */
+	NVRAM_T_U8,  NVRAM_T_I8,
+	NVRAM_T_U16, NVRAM_T_I16,
+	NVRAM_T_U32, NVRAM_T_I32,
+	NVRAM_T_U64, NVRAM_T_I64,
+	NVRAM_T_F32, NVRAM_T_F64,
+} nvram_type_e;
+
+/**< a layout descriptor as it is stored in a file, so an image written with
+ * a different layout can be migrated field by field */
+typedef struct {
+	char name[48];   /**< name of the variable, NUL terminated */
+	uint64_t offset; /**< offset of the variable within the image */
+	uint32_t size;   /**< size of the variable in bytes */
+	uint32_t type;   /**< an nvram_type_e */
+} nvram_field_t;
+
+/**< A journal record, followed by 'length' bytes of the section and padding
+ * up to a multiple of 8 bytes. A torn or stale record fails its checksum,
+ * which is seeded with the layout hash so records written for a different
+ * layout are never applied. */
+typedef struct {
+	uint64_t lsn;    /**< log sequence number, one more than the previous record */
+	uint64_t offset; /**< offset of the bytes within the section */
+	uint32_t length; /**< number of bytes */
+	uint32_t crc;    /**< CRC-32C of the record up to this field and the bytes */
+} nvram_record_t;
+
+/**< How the image is stored. A compressed image is a table holding the size
+ * of each compressed chunk (a size equal to that of the chunk means it is
+ * stored as it is) followed by the chunks, each on its own so that they can
+ * be decompressed in any order, 'table' follows the last chunk. A wrong
+ * codec is caught by the checksums of the chunks, which are of the data. */
+typedef enum {
+	NVRAM_CODEC_NONE, /**< the image is stored as it is */
+	NVRAM_CODEC_LZ4,  /**< each chunk is compressed as an LZ4 block */
+} nvram_codec_e;
+
+/**< Header for a slot in an A/B file, slot 'n' has its header at the start of
+ * page 'n' of the file and the image elsewhere in the file. The header with
+ * the highest generation whose checksums are valid holds the newest data.
+ * Headers are written after the image they describe is on disk. Files without
+ * slots store the image, followed by its table of checksums and then the same
+ * structure as a trailer. The image is checksummed in chunks so a save only
+ * has to checksum the chunks that changed, the header checksums the table. */
+typedef struct {
+	uint64_t magic;      /**< NVRAM_MAGIC */
+	uint64_t generation; /**< incremented on every save */
+	uint64_t offset;     /**< offset of the image within the file */
+	uint64_t length;     /**< length of the image */
+	uint64_t table;      /**< offset of the table of CRC-32Cs, one per chunk of the image */
+	uint64_t fields;     /**< offset of the table of fields describing the image */
+	uint64_t lsn;        /**< last journal record included in the image */
+	uint32_t chunk;      /**< size of a chunk */
+	uint32_t count;      /**< number of fields */
+	uint32_t table_crc;  /**< CRC-32C of the table */
+	uint32_t layout;     /**< CRC-32C of the fields, a hash of the layout of the image */
+	uint32_t header_crc; /**< CRC-32C of the header up to this field */
+	uint32_t codec;      /**< an nvram_codec_e, in what was padding so is zero in older files and not covered by 'header_crc' */
+} nvram_header_t;
+
+#define NVRAM_LIVE_MAGIC (0x4556494c4d41524eULL) /**< "NRAMLIVE", marks a valid live header */
+
+/**< Live header of a shared section, kept in a file of its own ('live_name')
+ * that the writer and any readers map. The whole pages of the section are
+ * read from the image file, which the writer maps over the section, and the
+ * partial last page, which cannot be mapped, from 'tail'. */
+typedef struct {
+	uint64_t magic;        /**< NVRAM_LIVE_MAGIC, written once the header is ready */
+	uint64_t sequence;     /**< seqlock, odd whilst the writer is updating the section */
+	uint64_t length;       /**< length of the section */
+	uint32_t layout;       /**< hash of the layout of the section */
+	uint32_t pid;          /**< process writing the section */
+	char tail[NVRAM_PAGE]; /**< copy of the partial last page of the section */
+} nvram_live_t;
+
+#define NVRAM_DELTA_MAGIC (0x41544c454d41524eULL) /**< "NRAMELTA", marks a record in a history file */
+
+/**< Record in a history file ('history_name'), the file holds a record for
+ * each of the last few saves, oldest first. Each record holds the exclusive
+ * or of the image saved and the image before it, which turns either image
+ * into the other, encoded as a series of runs of 64-bit words: a pair of
+ * words holding the number of words that are the same and then the number
+ * that differ, followed by the exclusive or of those that differ. The last
+ * word may be partial, if the length of the image is not a multiple of 8. */
+typedef struct {
+	uint64_t magic;      /**< NVRAM_DELTA_MAGIC */
+	uint64_t from;       /**< generation of the image before the save */
+	uint64_t to;         /**< generation of the image saved */
+	uint64_t length;     /**< length of the images */
+	uint64_t size;       /**< bytes of encoded runs following this record */
+	uint32_t layout;     /**< hash of the layout of the images */
+	uint32_t crc;        /**< CRC-32C of the encoded runs */
+	uint32_t reserved;
+	uint32_t header_crc; /**< CRC-32C of the record up to this field */
+} nvram_delta_t;
+
+#endif
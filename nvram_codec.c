@@ -0,0 +1,227 @@
+/**@file nvram_codec.c
+ * @license MIT
+ * @author Richard James Howe
+ * @copyright Richard James Howe (2017)
+ * @brief CRC-32C (Castagnoli), with the SSE4.2 instruction where there is
+ * one, and LZ4 block compression, as used by the files written by 'nvram.c'
+ * and read by 'nvram_image.c'. */
+
+#include "nvram_codec.h"
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define CRC32C_STRIDE (4096) /**< bytes per stream when computing three checksums in parallel */
+
+static uint32_t crc32c_table[8][256]; /**< slicing-by-8 tables for CRC-32C (Castagnoli) */
+static uint32_t crc32c_zeros[4][256]; /**< advances a CRC-32C register over CRC32C_STRIDE zero bytes */
+uint32_t (*nvram_crc32c_update)(uint32_t crc, const unsigned char *d, size_t length);
+
+/**< advance the CRC-32C register 'crc' over CRC32C_STRIDE zero bytes */
+static inline uint32_t crc32c_shift(uint32_t crc)
+{
+	return crc32c_zeros[0][crc & 0xFF] ^ crc32c_zeros[1][(crc >> 8) & 0xFF]
+		^ crc32c_zeros[2][(crc >> 16) & 0xFF] ^ crc32c_zeros[3][crc >> 24];
+}
+
+/**< portable CRC-32C, processing eight bytes at a time */
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *d, size_t length)
+{
+	for (; length >= 8; d += 8, length -= 8) {
+		const uint32_t lo = crc ^ (d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24));
+		crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF]
+			^ crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24]
+			^ crc32c_table[3][d[4]] ^ crc32c_table[2][d[5]]
+			^ crc32c_table[1][d[6]] ^ crc32c_table[0][d[7]];
+	}
+	while (length--)
+		crc = crc32c_table[0][(crc ^ *d++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+/**< CRC-32C with the SSE4.2 "crc32" instruction, which has a latency of three
+ * cycles but a throughput of one per cycle, so three independent streams are
+ * computed at once and combined, which is enough to keep up with memory */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *d, size_t length)
+{
+	uint64_t w = 0;
+	for (; length && ((uintptr_t)d & 7); length--)
+		crc = _mm_crc32_u8(crc, *d++);
+	for (; length >= 3 * CRC32C_STRIDE; d += 3 * CRC32C_STRIDE, length -= 3 * CRC32C_STRIDE) {
+		uint64_t a = crc, b = 0, c = 0;
+		for (size_t i = 0; i < CRC32C_STRIDE; i += 8) {
+			a = _mm_crc32_u64(a, *(const uint64_t*)(d + i));
+			b = _mm_crc32_u64(b, *(const uint64_t*)(d + CRC32C_STRIDE + i));
+			c = _mm_crc32_u64(c, *(const uint64_t*)(d + (2 * CRC32C_STRIDE) + i));
+		}
+		crc = crc32c_shift(crc32c_shift(a) ^ b) ^ c;
+	}
+	for (; length >= 8; d += 8, length -= 8) {
+		memcpy(&w, d, 8);
+		crc = _mm_crc32_u64(crc, w);
+	}
+	while (length--)
+		crc = _mm_crc32_u8(crc, *d++);
+	return crc;
+}
+#endif
+
+static void crc32c_generate(void)
+{
+	uint32_t basis[32];
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+		crc32c_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; i++)
+		for (int j = 1; j < 8; j++)
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xFF] ^ (crc32c_table[j - 1][i] >> 8);
+	/* advancing over zeros is linear, so find where each bit goes and build
+	 * the byte tables from that */
+	for (int i = 0; i < 32; i++) {
+		uint32_t c = 1u << i;
+		for (size_t j = 0; j < CRC32C_STRIDE; j++)
+			c = crc32c_table[0][c & 0xFF] ^ (c >> 8);
+		basis[i] = c;
+	}
+	for (int i = 0; i < 4; i++)
+		for (uint32_t j = 0; j < 256; j++) {
+			uint32_t c = 0;
+			for (int k = 0; k < 8; k++)
+				if (j & (1u << k))
+					c ^= basis[(i * 8) + k];
+			crc32c_zeros[i][j] = c;
+		}
+	nvram_crc32c_update = crc32c_software;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		nvram_crc32c_update = crc32c_sse42;
+#endif
+}
+
+void nvram_crc32c_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, crc32c_generate);
+}
+
+uint32_t nvram_crc32c(uint32_t crc, const void *data, size_t length)
+{
+	nvram_crc32c_init();
+	return ~nvram_crc32c_update(~crc, data, length);
+}
+
+#define LZ4_MIN_MATCH (4u)   /**< shortest match that can be encoded */
+#define LZ4_LAST      (5u)   /**< the last bytes of a block are always literals */
+#define LZ4_MF_LIMIT  (12u)  /**< no match starts within this many bytes of the end of a block */
+#define LZ4_HASH      (12u)  /**< log2 of the entries in the table of positions used to find matches */
+
+static inline uint32_t lz4_read32(const unsigned char *p)
+{
+	uint32_t v = 0;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+/**< write a length of 15 or more as the extra bytes that follow a token */
+static inline unsigned char *lz4_length(unsigned char *op, const unsigned char *end, size_t length)
+{
+	for (; length >= 255 && op < end; length -= 255)
+		*op++ = 255;
+	if (op < end)
+		*op++ = length;
+	return op;
+}
+
+size_t nvram_lz4_compress(const unsigned char *in, size_t length, unsigned char *out, size_t capacity)
+{
+	uint32_t table[1u << LZ4_HASH];
+	const unsigned char *const end = out + capacity;
+	unsigned char *op = out;
+	size_t ip = 0, anchor = 0;
+	memset(table, 0, sizeof table);
+	for (unsigned misses = 0; length >= LZ4_MF_LIMIT && ip < length - LZ4_MF_LIMIT;) {
+		const uint32_t sequence = lz4_read32(in + ip);
+		const uint32_t h = (sequence * 2654435761u) >> (32 - LZ4_HASH);
+		const size_t ref = table[h];
+		table[h] = ip;
+		if (ref >= ip || ip - ref > 65535 || lz4_read32(in + ref) != sequence) {
+			ip += 1 + (misses++ >> 6);
+			continue;
+		}
+		size_t match = LZ4_MIN_MATCH;
+		while (ip + match < length - LZ4_LAST && in[ref + match] == in[ip + match])
+			match++;
+		const size_t literals = ip - anchor;
+		if (op >= end)
+			return 0;
+		unsigned char *token = op++;
+		*token = ((literals < 15 ? literals : 15) << 4) | (match - LZ4_MIN_MATCH < 15 ? match - LZ4_MIN_MATCH : 15);
+		if (literals >= 15)
+			op = lz4_length(op, end, literals - 15);
+		if ((size_t)(end - op) < literals + 2)
+			return 0;
+		memcpy(op, in + anchor, literals);
+		op += literals;
+		*op++ = (ip - ref) & 0xFF;
+		*op++ = (ip - ref) >> 8;
+		if (match - LZ4_MIN_MATCH >= 15)
+			op = lz4_length(op, end, match - LZ4_MIN_MATCH - 15);
+		ip += match;
+		anchor = ip;
+		misses = 0;
+	}
+	const size_t literals = length - anchor;
+	if (op >= end)
+		return 0;
+	unsigned char *token = op++;
+	*token = (literals < 15 ? literals : 15) << 4;
+	if (literals >= 15)
+		op = lz4_length(op, end, literals - 15);
+	if ((size_t)(end - op) < literals)
+		return 0;
+	memcpy(op, in + anchor, literals);
+	return (op + literals) - out;
+}
+
+int nvram_lz4_decompress(const unsigned char *in, size_t size, unsigned char *out, size_t length)
+{
+	size_t ip = 0, op = 0;
+	while (ip < size) {
+		const unsigned token = in[ip++];
+		size_t literals = token >> 4, match = token & 15;
+		if (literals == 15)
+			for (unsigned char b = 255; b == 255 && ip < size; literals += b)
+				b = in[ip++];
+		if (literals > size - ip || literals > length - op)
+			return -1;
+		memcpy(out + op, in + ip, literals);
+		ip += literals;
+		op += literals;
+		if (ip == size) /* the last sequence only has literals */
+			break;
+		if (size - ip < 2)
+			return -1;
+		const size_t offset = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		if (match == 15)
+			for (unsigned char b = 255; b == 255 && ip < size; match += b)
+				b = in[ip++];
+		match += LZ4_MIN_MATCH;
+		if (!offset || offset > op || match > length - op)
+			return -1;
+		if (offset >= match) {
+			memcpy(out + op, out + op - offset, match);
+			op += match;
+		} else {
+			for (; match; match--, op++) /* the match overlaps what it copies, as in a run */
+				out[op] = out[op - offset];
+		}
+	}
+	return op == length ? 0 : -1;
+}
@@ -0,0 +1,45 @@
+/**@file nvram_codec.h
+ * @license MIT
+ * @author Richard James Howe
+ * @copyright Richard James Howe (2017)
+ * @brief The checksum and compression used by the files written by 'nvram.c',
+ * see 'nvram_codec.c'. Shared by 'nvram.c' and 'nvram_image.c' so that the
+ * tools reading the files check and decompress them as fast, and in exactly
+ * the same way, as the program writing them. */
+#ifndef NVRAM_CODEC_H
+#define NVRAM_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**< generate the tables and choose the implementation of CRC-32C, once. This
+ * is not async-signal-safe, so it must be called before any signal handler
+ * that checksums data is installed ('nvram_initialize' does), after which the
+ * handler can call 'nvram_crc32c_update' */
+void nvram_crc32c_init(void);
+
+/**< the CRC-32C implementation chosen by 'nvram_crc32c_init', it takes and
+ * returns the register rather than the checksum, which is its complement */
+extern uint32_t (*nvram_crc32c_update)(uint32_t crc, const unsigned char *d, size_t length);
+
+/**< CRC-32C of 'length' bytes of 'data', 'crc' is 0 or the result of a
+ * previous call to continue a checksum over multiple buffers */
+uint32_t nvram_crc32c(uint32_t crc, const void *data, size_t length);
+
+/**< Compress the 'length' bytes of 'in' into an LZ4 block, a series of
+ * sequences each made of a token (the number of literals and the length of
+ * the match that follow in its upper and lower four bits), the literals, and
+ * the offset of the match back from the current position. Matches are found
+ * greedily with a table of the positions of the last four byte sequence
+ * with each hash, and the search skips ahead faster the longer it goes
+ * without finding one, so incompressible data is passed over quickly.
+ * @return size of the block, or 0 if it does not fit in 'capacity' bytes */
+size_t nvram_lz4_compress(const unsigned char *in, size_t length, unsigned char *out, size_t capacity);
+
+/**< Decompress the LZ4 block of 'size' bytes in 'in', which must decompress
+ * to exactly 'length' bytes, into 'out'. Every length and offset is checked
+ * so that a corrupt block cannot read or write out of bounds.
+ * @return 0 on success, 0< if the block is invalid */
+int nvram_lz4_decompress(const unsigned char *in, size_t size, unsigned char *out, size_t length);
+
+#endif
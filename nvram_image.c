@@ -0,0 +1,286 @@
+/**@file nvram_image.c
+ * @license MIT
+ * @author Richard James Howe
+ * @copyright Richard James Howe (2017)
+ * @brief Find the newest valid image in a file written by 'nvram.c' and get
+ * or set its variables. Every image is stored with a table describing the
+ * variables it holds (see 'NVRAM_LAYOUT' in 'nvram.c'), so this needs neither
+ * the program that wrote the file nor its source. A file is mapped and the
+ * variables are read straight out of the mapping, a compressed image is
+ * decompressed, which is the only time anything is copied. */
+
+#include "nvram_image.h"
+#include "nvram_codec.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/**< check each chunk of 'image' against the table of checksums 'table' */
+static bool nvram_image_chunks(const nvram_header_t *h, const unsigned char *image, const unsigned char *table)
+{
+	const uint64_t chunks = (h->length + NVRAM_PAGE - 1) / NVRAM_PAGE;
+	for (uint64_t i = 0; i < chunks; i++) {
+		const uint64_t at = i * NVRAM_PAGE;
+		uint32_t crc = 0;
+		memcpy(&crc, table + (i * sizeof crc), sizeof crc);
+		if (nvram_crc32c(0, image + at, h->length - at < NVRAM_PAGE ? h->length - at : NVRAM_PAGE) != crc)
+			return false;
+	}
+	return true;
+}
+
+/**< decompress the image, which is stored as described for 'nvram_codec_e'
+ * @return 0 on success, 0< on failure */
+static int nvram_image_unpack(nvram_image_t *im)
+{
+	const nvram_header_t *h = &im->header;
+	const uint64_t chunks = (h->length + NVRAM_PAGE - 1) / NVRAM_PAGE;
+	const uint64_t size = h->table - h->offset;
+	uint64_t at = chunks * sizeof (uint32_t);
+	if (at > size || !(im->unpacked = malloc(h->length + 1)))
+		return -1;
+	for (uint64_t i = 0; i < chunks; i++) {
+		const uint64_t offset = i * NVRAM_PAGE, n = h->length - offset < NVRAM_PAGE ? h->length - offset : NVRAM_PAGE;
+		uint32_t packs = 0;
+		memcpy(&packs, im->file + h->offset + (i * sizeof packs), sizeof packs);
+		if (!packs || packs > n || packs > size - at)
+			return -1;
+		if (packs == n)
+			memcpy(im->unpacked + offset, im->file + h->offset + at, n);
+		else if (nvram_lz4_decompress(im->file + h->offset + at, packs, im->unpacked + offset, n) < 0)
+			return -1;
+		at += packs;
+	}
+	im->image = im->unpacked;
+	return 0;
+}
+
+/**< check the header at 'offset' in the file and that the image and tables
+ * it describes are within the file, their checksums are checked if
+ * 'verify' is set, otherwise only the header and the table of fields are */
+static bool nvram_image_header(const nvram_image_t *im, size_t offset, nvram_header_t *h, bool verify)
+{
+	assert(im);
+	assert(h);
+	if (offset > im->size || im->size - offset < sizeof *h)
+		return false;
+	memcpy(h, im->file + offset, sizeof *h);
+	if ((h->magic != NVRAM_MAGIC && h->magic != NVRAM_OPEN_MAGIC) || h->chunk != NVRAM_PAGE || h->codec > NVRAM_CODEC_LZ4
+			|| h->header_crc != nvram_crc32c(0, h, offsetof(nvram_header_t, header_crc)))
+		return false;
+	const uint64_t chunks = (h->length + NVRAM_PAGE - 1) / NVRAM_PAGE;
+	const uint64_t stored = h->codec ? h->table - h->offset : h->length; /* compressed images end at the table */
+	if (h->offset > im->size || (h->codec && h->table < h->offset) || stored > im->size - h->offset
+			|| h->table > im->size || chunks * sizeof (uint32_t) > im->size - h->table
+			|| h->fields > im->size || h->count * sizeof (nvram_field_t) > im->size - h->fields)
+		return false;
+	if (nvram_crc32c(0, im->file + h->fields, h->count * sizeof (nvram_field_t)) != h->layout)
+		return false;
+	if (!verify)
+		return true;
+	if (nvram_crc32c(0, im->file + h->table, chunks * sizeof (uint32_t)) != h->table_crc)
+		return false;
+	return h->codec || nvram_image_chunks(h, im->file + h->offset, im->file + h->table); /* checked once decompressed */
+}
+
+int nvram_image_open(nvram_image_t *im, const char *name, bool verify, bool writable)
+{
+	struct stat s;
+	nvram_header_t h;
+	assert(im);
+	assert(name);
+	memset(im, 0, sizeof *im);
+	im->name = name;
+	im->writable = writable;
+	errno = 0;
+	const int fd = open(name, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0 || fstat(fd, &s) < 0 || s.st_size < (off_t)sizeof h) {
+		fprintf(stderr, "%s: %s\n", name, errno ? strerror(errno) : "too small");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	im->size = s.st_size;
+	im->file = mmap(NULL, im->size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	close(fd);
+	if (im->file == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed: %s\n", name, strerror(errno));
+		im->file = NULL;
+		return -1;
+	}
+	bool found = false;
+	uint64_t magic = 0;
+	memcpy(&magic, im->file, sizeof magic);
+	if (magic == NVRAM_MAGIC) { /* A/B slots */
+		for (size_t slot = 0; slot < 2; slot++)
+			if (nvram_image_header(im, slot * NVRAM_PAGE, &h, verify) && (!found || h.generation > im->header.generation))
+				im->header = h, im->at = slot * NVRAM_PAGE, found = true;
+	} else if (nvram_image_header(im, im->size - sizeof h, &h, verify) && h.offset == 0) {
+		im->header = h, im->at = im->size - sizeof h, found = true;
+	}
+	if (!found) {
+		fprintf(stderr, "%s: no valid image\n", name);
+		munmap((void*)im->file, im->size);
+		im->file = NULL;
+		return -1;
+	}
+	im->image = im->file + im->header.offset;
+	if (im->header.codec && (nvram_image_unpack(im) < 0
+			|| (verify && !nvram_image_chunks(&im->header, im->image, im->file + im->header.table)))) {
+		fprintf(stderr, "%s: compressed image is corrupt\n", name);
+		free(im->unpacked);
+		munmap((void*)im->file, im->size);
+		im->file = NULL;
+		im->unpacked = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void nvram_image_close(nvram_image_t *im)
+{
+	assert(im);
+	if (im->file)
+		munmap((void*)im->file, im->size);
+	free(im->unpacked);
+	im->file = NULL;
+	im->unpacked = NULL;
+}
+
+void nvram_image_field(const nvram_image_t *im, uint32_t i, nvram_field_t *f)
+{
+	assert(im);
+	assert(f);
+	assert(i < im->header.count);
+	memcpy(f, im->file + im->header.fields + (i * sizeof *f), sizeof *f);
+	f->name[sizeof f->name - 1] = '\0';
+}
+
+bool nvram_image_find(const nvram_image_t *im, const char *name, nvram_field_t *f)
+{
+	assert(im);
+	assert(name);
+	for (uint32_t i = 0; i < im->header.count; i++) {
+		nvram_image_field(im, i, f);
+		if (!strcmp(f->name, name))
+			return f->offset <= im->header.length && f->size <= im->header.length - f->offset;
+	}
+	return false;
+}
+
+int nvram_image_print(FILE *out, const nvram_image_t *im, const nvram_field_t *f)
+{
+	union { uint8_t u8; int8_t i8; uint16_t u16; int16_t i16; uint32_t u32; int32_t i32;
+		uint64_t u64; int64_t i64; float f32; double f64; } v;
+	assert(out);
+	assert(im);
+	assert(f);
+	const unsigned char *p = im->image + f->offset;
+	memset(&v, 0, sizeof v);
+	if (f->offset > im->header.length || f->size > im->header.length - f->offset)
+		return -1;
+	if (f->type != NVRAM_T_BLOB && f->size <= sizeof v)
+		memcpy(&v, p, f->size);
+	switch (f->type) {
+	case NVRAM_T_U8:  return fprintf(out, "%"PRIu8, v.u8)   < 0 ? -1 : 0;
+	case NVRAM_T_I8:  return fprintf(out, "%"PRId8, v.i8)   < 0 ? -1 : 0;
+	case NVRAM_T_U16: return fprintf(out, "%"PRIu16, v.u16) < 0 ? -1 : 0;
+	case NVRAM_T_I16: return fprintf(out, "%"PRId16, v.i16) < 0 ? -1 : 0;
+	case NVRAM_T_U32: return fprintf(out, "%"PRIu32, v.u32) < 0 ? -1 : 0;
+	case NVRAM_T_I32: return fprintf(out, "%"PRId32, v.i32) < 0 ? -1 : 0;
+	case NVRAM_T_U64: return fprintf(out, "%"PRIu64" (0x%"PRIx64")", v.u64, v.u64) < 0 ? -1 : 0;
+	case NVRAM_T_I64: return fprintf(out, "%"PRId64, v.i64) < 0 ? -1 : 0;
+	case NVRAM_T_F32: return fprintf(out, "%g", v.f32) < 0 ? -1 : 0;
+	case NVRAM_T_F64: return fprintf(out, "%g", v.f64) < 0 ? -1 : 0;
+	default:
+		for (uint32_t i = 0; i < f->size; i++)
+			if (fprintf(out, "%02x", p[i]) < 0)
+				return -1;
+		return 0;
+	}
+}
+
+int nvram_image_set(nvram_image_t *im, const nvram_field_t *f, const char *value)
+{
+	union { uint8_t u8; uint16_t u16; uint32_t u32; uint64_t u64; float f32; double f64; } v;
+	unsigned char *file = (unsigned char*)im->file, *bytes = NULL;
+	char *end = NULL;
+	assert(im);
+	assert(f);
+	assert(value);
+	if (!im->writable || f->offset > im->header.length || f->size > im->header.length - f->offset)
+		return -1;
+	if (im->header.codec) {
+		fprintf(stderr, "%s: compressed images cannot be changed, save it uncompressed first\n", im->name);
+		return -1;
+	}
+	memset(&v, 0, sizeof v);
+	errno = 0;
+	switch (f->type) {
+	case NVRAM_T_U8: case NVRAM_T_U16: case NVRAM_T_U32: case NVRAM_T_U64: {
+		const unsigned long long u = strtoull(value, &end, 0);
+		if (f->size < 8 && u >> (f->size * 8))
+			errno = ERANGE;
+		v.u64 = u;
+		break;
+	}
+	case NVRAM_T_I8: case NVRAM_T_I16: case NVRAM_T_I32: case NVRAM_T_I64: {
+		const long long i = strtoll(value, &end, 0);
+		if (f->size < 8 && (i < -(1ll << (f->size * 8 - 1)) || i >= (1ll << (f->size * 8 - 1))))
+			errno = ERANGE;
+		v.u64 = i;
+		break;
+	}
+	case NVRAM_T_F32: v.f32 = strtof(value, &end); break;
+	case NVRAM_T_F64: v.f64 = strtod(value, &end); break;
+	default:
+		if (strlen(value) != (size_t)f->size * 2 || strspn(value, "0123456789abcdefABCDEF") != (size_t)f->size * 2) {
+			fprintf(stderr, "%s: '%s' needs %"PRIu32" hexadecimal bytes\n", im->name, f->name, f->size);
+			return -1;
+		}
+		if (!(bytes = malloc(f->size + 1))) /* sized from the field, blobs can be any size */
+			return -1;
+		for (uint32_t i = 0; i < f->size; i++) {
+			unsigned byte = 0;
+			sscanf(value + (i * 2), "%2x", &byte);
+			bytes[i] = byte;
+		}
+		end = (char*)value + ((size_t)f->size * 2);
+	}
+	if (errno || !end || end == value || *end) {
+		fprintf(stderr, "%s: '%s' is not a valid value for '%s'\n", im->name, value, f->name);
+		free(bytes);
+		return -1;
+	}
+	if (f->type != NVRAM_T_BLOB) { /* the numeric types are stored in the byte order of this machine */
+		if (f->size > sizeof v)
+			return -1;
+		if (f->size == 1) v.u8 = v.u64; /* narrow the integers to their size */
+		else if (f->size == 2) v.u16 = v.u64;
+		else if (f->size == 4 && f->type != NVRAM_T_F32) v.u32 = v.u64;
+	}
+	memcpy(file + im->header.offset + f->offset, bytes ? bytes : (unsigned char*)&v, f->size);
+	free(bytes);
+
+	nvram_header_t *h = &im->header;
+	for (uint64_t i = f->offset / NVRAM_PAGE; f->size && i <= (f->offset + f->size - 1) / NVRAM_PAGE; i++) {
+		const uint64_t at = i * NVRAM_PAGE;
+		const uint32_t crc = nvram_crc32c(0, file + h->offset + at, h->length - at < NVRAM_PAGE ? h->length - at : NVRAM_PAGE);
+		memcpy(file + h->table + (i * sizeof crc), &crc, sizeof crc);
+	}
+	h->table_crc  = nvram_crc32c(0, file + h->table, ((h->length + NVRAM_PAGE - 1) / NVRAM_PAGE) * sizeof (uint32_t));
+	h->header_crc = nvram_crc32c(0, h, offsetof(nvram_header_t, header_crc));
+	memcpy(file + im->at, h, sizeof *h);
+	if (msync(file, im->size, MS_SYNC) < 0) {
+		fprintf(stderr, "%s: msync failed: %s\n", im->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,59 @@
+/**@file nvram_image.h
+ * @license MIT
+ * @author Richard James Howe
+ * @copyright Richard James Howe (2017)
+ * @brief A library for reading, and changing variables in, the files written
+ * by 'nvram.c' without the program that wrote them, see 'nvram_image.c'. It
+ * is used by 'inspect.c' and can be linked into other tools. */
+#ifndef NVRAM_IMAGE_H
+#define NVRAM_IMAGE_H
+
+#include "nvram.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**< a file written by 'nvram.c', mapped read only unless it is opened for writing */
+typedef struct {
+	const char *name;          /**< name of the file */
+	const unsigned char *file; /**< contents of the file */
+	size_t size;               /**< size of the file */
+	nvram_header_t header;     /**< header of the newest valid image in the file */
+	size_t at;                 /**< offset of 'header' in the file */
+	const unsigned char *image; /**< the image, within 'file' or 'unpacked' */
+	unsigned char *unpacked;   /**< the image decompressed, if it is compressed */
+	bool writable;             /**< the file is mapped for writing, see 'nvram_image_set' */
+} nvram_image_t;
+
+/**< Map the file 'name' and find its newest valid image, which is either
+ * held in one of two slots, whose headers start the first two pages, or is at
+ * the start of the file with a trailer at its end. If 'verify' is set the
+ * image is checked against its checksums, the file is only mapped for
+ * writing if 'writable' is set.
+ * @return 0 on success, 0< on failure */
+int nvram_image_open(nvram_image_t *im, const char *name, bool verify, bool writable);
+
+/**< unmap the file and free anything 'nvram_image_open' allocated */
+void nvram_image_close(nvram_image_t *im);
+
+/**< get field 'i' of the image, 'f' is filled in as the table in the file
+ * need not be aligned */
+void nvram_image_field(const nvram_image_t *im, uint32_t i, nvram_field_t *f);
+
+/**< find the variable called 'name' in the image
+ * @return true if it was found, and 'f' filled in */
+bool nvram_image_find(const nvram_image_t *im, const char *name, nvram_field_t *f);
+
+/**< print the value of the variable 'f' in the image to 'out' */
+int nvram_image_print(FILE *out, const nvram_image_t *im, const nvram_field_t *f);
+
+/**< Set the variable 'f' in an image opened for writing to 'value', which is
+ * a number for the numeric types (in decimal, or hexadecimal prefixed with
+ * "0x") and a string of hexadecimal bytes, in memory order, otherwise. The
+ * checksums of the chunks changed, the table and the header are updated and
+ * the file is synchronized.
+ * @return 0 on success, 0< on failure */
+int nvram_image_set(nvram_image_t *im, const nvram_field_t *f, const char *value);
+
+#endif